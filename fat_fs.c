@@ -30,6 +30,77 @@
 #include "fat_misc.h"
 
 
+/*******************************************************************
+* FAT entry accessors
+* The FAT sector holding the entry must be loaded into the buffer.
+* With FAT_ONLY_FAT16 or FAT_ONLY_FAT32 the type checks are constant
+* and only one variant is compiled in.
+*/
+#define FAT16_ENTRY(sd, cluster)	(((uint16_t *)(sd)->buffer)[(cluster) & (sd)->entry_mask])
+#define FAT32_ENTRY(sd, cluster)	(((uint32_t *)(sd)->buffer)[(cluster) & (sd)->entry_mask])
+
+static inline uint32_t fat16_entry_get(sdcard_t *sdcard, uint32_t cluster)
+{
+	uint32_t value = FAT16_ENTRY(sdcard, cluster);
+	
+	return (value >= 0xFFF8 ? 0xFFFFFFFF : value);
+}
+
+static inline uint32_t fat32_entry_get(sdcard_t *sdcard, uint32_t cluster)
+{
+	uint32_t value = FAT32_ENTRY(sdcard, cluster) & 0x0FFFFFFF;
+	
+	return (value >= 0x0FFFFFF8 ? 0xFFFFFFFF : value);
+}
+
+static inline void fat16_entry_set(sdcard_t *sdcard, uint32_t cluster, uint32_t value)
+{
+	FAT16_ENTRY(sdcard, cluster) = (uint16_t)value;
+}
+
+static inline void fat32_entry_set(sdcard_t *sdcard, uint32_t cluster, uint32_t value)
+{
+	// The upper four bits are reserved and must be preserved
+	FAT32_ENTRY(sdcard, cluster) = (FAT32_ENTRY(sdcard, cluster) & 0xF0000000) | (value & 0x0FFFFFFF);
+}
+
+/* Next cluster of a chain, end of chain markers are returned as 0xFFFFFFFF */
+static inline uint32_t fat_entry_get(sdcard_t *sdcard, uint32_t cluster)
+{
+	return (FAT_IS_FAT16(sdcard) ? fat16_entry_get(sdcard, cluster) : fat32_entry_get(sdcard, cluster));
+}
+
+static inline void fat_entry_set(sdcard_t *sdcard, uint32_t cluster, uint32_t value)
+{
+	if(FAT_IS_FAT16(sdcard))
+	{
+		fat16_entry_set(sdcard, cluster, value);
+	}
+	else
+	{
+		fat32_entry_set(sdcard, cluster, value);
+	}
+}
+
+/* Absolute sector of the FAT entry for a cluster */
+static inline uint32_t fat_entry_sector(sdcard_t *sdcard, uint32_t cluster)
+{
+	return sdcard->fat_begin_sector + (cluster >> sdcard->entry_shift);
+}
+
+/* Strip the reserved FAT32 bits from a cluster number */
+static inline uint32_t fat_entry_cluster(sdcard_t *sdcard, uint32_t cluster)
+{
+	return (FAT_IS_FAT16(sdcard) ? cluster : (cluster & 0x0FFFFFFF));
+}
+
+/* Cluster number is an end of chain or bad cluster marker */
+static inline uint8_t fat_entry_is_end(sdcard_t *sdcard, uint32_t cluster)
+{
+	return (FAT_IS_FAT16(sdcard) ? (cluster >= 0xFFF8) : (cluster >= 0x0FFFFFF8));
+}
+
+
 /*******************************************************************
 * Read the master boot record and set partition info in sdcard
 * structure
@@ -88,13 +159,30 @@ uint8_t read_mbr(sdcard_t *sdcard)
 	
 	// Debug	
 	printf("MBR OK\n");
-	printf("Part. start:   %lu\n", sdcard->partition_start);
-	printf("Part. sectors: %lu\n", sdcard->partition_sectors);
+	printf("Part. start:   %lu\n", (unsigned long)sdcard->partition_start);
+	printf("Part. sectors: %lu\n", (unsigned long)sdcard->partition_sectors);
 
 	return 1;
 }
 
 
+/*******************************************************************
+* Base 2 logarithm of a power of two
+*/
+static uint8_t fat_log2(uint32_t value)
+{
+	uint8_t shift = 0;
+	
+	while(value > 1)
+	{
+		value >>= 1;
+		shift++;
+	}
+	
+	return shift;
+}
+
+
 /*******************************************************************
 * Read the boot sector of a FAT partition
 */
@@ -106,6 +194,10 @@ uint8_t fat_read_bootsector(sdcard_t *sdcard)
 		return 0;
 	}
 	
+	// Indexes and directories of a previous volume
+	fat_dir_index_clear(sdcard);
+	fat_dentry_clear(sdcard);
+	
 	if(!sd_read_block(sdcard, sdcard->partition_start, 0))
 	{
 		printf("BS: Read failed\n");
@@ -130,6 +222,22 @@ uint8_t fat_read_bootsector(sdcard_t *sdcard)
 		return 0;
 	}
 	
+	//
+	// Shifts and masks for the sector math, all sizes are powers of two.
+	// Needed before fat_get_cluster_sector() is used for the FAT32 root.
+	//
+	sdcard->sectors_per_cluster = bs->SecPerClus;
+	sdcard->sector_shift = fat_log2(sdcard->blocksize);
+	sdcard->sector_mask = sdcard->blocksize - 1;
+	sdcard->cluster_shift = fat_log2(sdcard->sectors_per_cluster);
+	sdcard->cluster_mask = sdcard->sectors_per_cluster - 1;
+	
+	if((1 << sdcard->cluster_shift) != sdcard->sectors_per_cluster)
+	{
+		printf("Sectors per cluster is not a power of two\n");
+		return 0;
+	}
+	
 	//
 	// Determine FAT type (from MS specs)
 	//
@@ -151,10 +259,16 @@ uint8_t fat_read_bootsector(sdcard_t *sdcard)
 	else if(totalclusters < 65525)
 	{
 		printf("FAT16 detected\n");
+		
+#if defined(FAT_ONLY_FAT32)
+		printf("FAT16 support not built in\n");
+		return 0;
+#endif
+		
 		sdcard->fattype = FAT16;
 		
-		// FSinfo sector
-		sdcard->fsinfo_sector = 1;
+		// No FSinfo sector on FAT16
+		sdcard->fsinfo_sector = 0;
 		
 		// FAT table first sector
 		sdcard->fat_begin_sector = sdcard->partition_start + bs->ResvdSecCnt;
@@ -175,14 +289,18 @@ uint8_t fat_read_bootsector(sdcard_t *sdcard)
 		sdcard->data_sectors = datasectors;
 		// Total data clusters
 		sdcard->data_clusters = totalclusters;
-		// Sectors per cluster
-		sdcard->sectors_per_cluster = bs->SecPerClus;
 	}
 	// FAT32
 	// Reserved - FAT - FAT copy - Data area
 	else
 	{
 		printf("FAT32 detected\n");
+		
+#if defined(FAT_ONLY_FAT16)
+		printf("FAT32 support not built in\n");
+		return 0;
+#endif
+		
 		sdcard->fattype = FAT32;
 		
 		// FSinfo sector
@@ -207,8 +325,6 @@ uint8_t fat_read_bootsector(sdcard_t *sdcard)
 		sdcard->data_sectors = datasectors;
 		// Total data clusters
 		sdcard->data_clusters = totalclusters;
-		// Sectors per cluster
-		sdcard->sectors_per_cluster = bs->SecPerClus;
 	
 		// Calculate root dir separately for FAT32
 		sdcard->rootdir_begin_sector = fat_get_cluster_sector(sdcard, sdcard->rootdir_begin_cluster);
@@ -218,114 +334,219 @@ uint8_t fat_read_bootsector(sdcard_t *sdcard)
 	// Debug	
 	printf("Bootsector OK\n");
 	printf("OEMName:       %s\n", bs->OEMName);
-	printf("fat_begin:     %lu\n", sdcard->fat_begin_sector);
-	printf("fat_sectors:   %lu\n", sdcard->fat_sectors);
-	printf("rootdir_begin:   %lu\n", sdcard->rootdir_begin_sector);
-	printf("rootdir_sectors: %lu\n", sdcard->rootdir_sectors);
-	printf("data_begin:    %lu\n", sdcard->data_begin_sector);
-	printf("data_sectors:  %lu\n", sdcard->data_sectors);
+	printf("fat_begin:     %lu\n", (unsigned long)sdcard->fat_begin_sector);
+	printf("fat_sectors:   %lu\n", (unsigned long)sdcard->fat_sectors);
+	printf("rootdir_begin:   %lu\n", (unsigned long)sdcard->rootdir_begin_sector);
+	printf("rootdir_sectors: %lu\n", (unsigned long)sdcard->rootdir_sectors);
+	printf("data_begin:    %lu\n", (unsigned long)sdcard->data_begin_sector);
+	printf("data_sectors:  %lu\n", (unsigned long)sdcard->data_sectors);
 	
 	printf("secperclus:    %d\n",sdcard->sectors_per_cluster);
-	printf("data_clusters: %lu\n", sdcard->data_clusters);
+	printf("data_clusters: %lu\n", (unsigned long)sdcard->data_clusters);
 		
 	printf("-- All done --\n");
 	
+	// FAT entries per sector depend on the FAT type
+	sdcard->entry_shift = sdcard->sector_shift - (sdcard->fattype == FAT16 ? 1 : 2);
+	sdcard->entry_mask = (1 << sdcard->entry_shift) - 1;
+	
+	//
+	// Allocation units, in clusters, counted from the first cluster
+	// that starts on an AU boundary of the card
+	//
+	sdcard->au_clusters = 0;
+	sdcard->au_first_cluster = 2;
+	
+	if(FAT_ALLOC_AU && sdcard->au_sectors > sdcard->sectors_per_cluster)
+	{
+		uint32_t offset = sdcard->data_begin_sector % sdcard->au_sectors;
+		
+		if(offset != 0)
+		{
+			sdcard->au_first_cluster += (sdcard->au_sectors - offset + sdcard->sectors_per_cluster - 1) / sdcard->sectors_per_cluster;
+		}
+		
+		sdcard->au_clusters = sdcard->au_sectors / sdcard->sectors_per_cluster;
+		
+		printf("au_clusters:   %lu (from %lu)\n", (unsigned long)sdcard->au_clusters, (unsigned long)sdcard->au_first_cluster);
+	}
+	
+	// Nothing known about free clusters yet
+	sdcard->free_ring_head = 0;
+	sdcard->free_ring_count = 0;
+	sdcard->free_ring_scan = 0;
+	
+	// Free cluster count and allocation hint
+	fat_read_fsinfo(sdcard);
+	
 	return 1;
 }
 
 
 /*******************************************************************
-* Update next free cluster in FSinfo sector
-*
+* Read the free cluster count and the next free cluster hint from
+* the FSinfo sector. Invalid or missing values are treated as unknown,
+* the free count is then found by fat_idle_work() in the background.
 */
-uint8_t fat_update_fsinfo(sdcard_t * sdcard)
+uint8_t fat_read_fsinfo(sdcard_t * sdcard)
 {
-	return 0;
+	fsinfo_t *fsinfo;
+	
+	sdcard->free_clusters = 0xFFFFFFFF;
+	sdcard->next_free_cluster = 2;
+	sdcard->fsinfo_dirty = 0;
+	sdcard->free_scan_sector = 0;
+	sdcard->free_scan_count = 0;
+	
+	// FAT16, keep the values in memory only
+	if(sdcard->fsinfo_sector == 0)
+	{
+		return 1;
+	}
+	
+	if(!sd_read_block(sdcard, (sdcard->partition_start + sdcard->fsinfo_sector), 0))
+	{
+		return 0;
+	}
+	
+	fsinfo = (fsinfo_t *)sdcard->buffer;
+	
+	// Verify signatures
+	if(fsinfo->LeadSig != 0x41615252 || fsinfo->StrucSig != 0x61417272 || fsinfo->TrailSig != 0xAA550000)
+	{
+		printf("FSInfo: Invalid signature\n");
+		sdcard->fsinfo_sector = 0;
+		return 0;
+	}
+	
+	if(fsinfo->Free_Count <= sdcard->data_clusters)
+	{
+		sdcard->free_clusters = fsinfo->Free_Count;
+	}
+	
+	if(fsinfo->Nxt_Free >= 2 && fsinfo->Nxt_Free <= (sdcard->data_clusters + 1))
+	{
+		sdcard->next_free_cluster = fsinfo->Nxt_Free;
+	}
+	
+	printf("free_clusters: %lu\n", (unsigned long)sdcard->free_clusters);
+	printf("next_free:     %lu\n", (unsigned long)sdcard->next_free_cluster);
+	
+	return 1;
 }
 
 
 /*******************************************************************
-* Print cluster usage
-* This is extremely slow :)
+* Write the free cluster count and the next free cluster hint back
+* to the FSinfo sector, if they have changed
+*
 */
-uint8_t fat_print_cluster_stats(sdcard_t * sdcard)
+uint8_t fat_update_fsinfo(sdcard_t * sdcard)
 {
-	uint32_t free_clusters = 0;
-	uint32_t used_clusters = 0;
+	fsinfo_t *fsinfo;
+	
+	if(!sdcard->fsinfo_dirty || sdcard->fsinfo_sector == 0)
+	{
+		return 1;
+	}
 	
-	uint16_t *fat16val;
-	uint32_t *fat32val;
-	uint32_t value;
-	uint32_t cluster = 2;
-	uint32_t sector = 0;
-	uint32_t offset = 0;
+	if(!sd_read_block(sdcard, (sdcard->partition_start + sdcard->fsinfo_sector), 0))
+	{
+		return 0;
+	}
 	
+	fsinfo = (fsinfo_t *)sdcard->buffer;
 	
-	while(1)
+	if(fsinfo->LeadSig != 0x41615252 || fsinfo->StrucSig != 0x61417272 || fsinfo->TrailSig != 0xAA550000)
 	{
-		// FAT16
-		if(sdcard->fattype == FAT16)
-		{
-			// Sector that contains the fat entry
-			sector = ((cluster * 2) / sdcard->blocksize);
-			// Offset from the start of the sector to the value we want
-			offset = ((cluster * 2) % sdcard->blocksize);
-		}
-		// FAT32
-		else
-		{
-			// Sector that contains the fat entry
-			sector = ((cluster * 4) / sdcard->blocksize);
-			// Offset from the start of the sector to the value we want
-			offset = ((cluster * 4) % sdcard->blocksize);
-		}
+		return 0;
+	}
 	
-		// Out of data clusters
-		if(cluster > sdcard->data_clusters + 1)
-		{
-			break;
-		}
+	fsinfo->Free_Count = sdcard->free_clusters;
+	fsinfo->Nxt_Free = sdcard->next_free_cluster;
+	
+	if(!sd_write_block(sdcard, (sdcard->partition_start + sdcard->fsinfo_sector), 0))
+	{
+		return 0;
+	}
+	
+	sdcard->fsinfo_dirty = 0;
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Bookkeeping after a cluster has been taken from the free pool.
+* Moves the allocation hint past it and updates the free count.
+*/
+static void fat_cluster_allocated(sdcard_t * sdcard, uint32_t cluster)
+{
+	if(cluster >= sdcard->next_free_cluster)
+	{
+		sdcard->next_free_cluster = cluster + 1;
 		
-		// Out of FAT sectors
-		if(sector > sdcard->fat_sectors)
+		if(sdcard->next_free_cluster > (sdcard->data_clusters + 1))
 		{
-			break;
+			sdcard->next_free_cluster = 2;
 		}
+	}
 	
-		// Read the sector
-		if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 0))
-		{
-			return 0;
-		}
+	if(sdcard->free_clusters != 0xFFFFFFFF && sdcard->free_clusters > 0)
+	{
+		sdcard->free_clusters--;
+	}
+	// Still counting, correct the part that has been counted already
+	else if(sdcard->free_clusters == 0xFFFFFFFF && (cluster >> sdcard->entry_shift) < sdcard->free_scan_sector && sdcard->free_scan_count > 0)
+	{
+		sdcard->free_scan_count--;
+	}
 	
-		// Get the value
-		if(sdcard->fattype == FAT16)
-		{
-			fat16val = (uint16_t *)&sdcard->buffer[offset];
-			value = *fat16val;
-		}
-		else
-		{
-			fat32val = (uint32_t *)&sdcard->buffer[offset];
-			value = *fat32val;
-		}
+	sdcard->fsinfo_dirty = 1;
+}
 
-		if(value == 0)
-		{
-			free_clusters++;
-		}
-		else
-		{
-			used_clusters++;
-		}
+
+/*******************************************************************
+* Bookkeeping after a cluster has been returned to the free pool
+* The hint is moved back so freed space is reused first.
+*/
+static void fat_cluster_freed(sdcard_t * sdcard, uint32_t cluster)
+{
+	if(cluster < sdcard->next_free_cluster)
+	{
+		sdcard->next_free_cluster = cluster;
+	}
+	
+	if(sdcard->free_clusters != 0xFFFFFFFF)
+	{
+		sdcard->free_clusters++;
+	}
+	else if((cluster >> sdcard->entry_shift) < sdcard->free_scan_sector)
+	{
+		sdcard->free_scan_count++;
+	}
+	
+	sdcard->fsinfo_dirty = 1;
+}
+
+
+/*******************************************************************
+* Print cluster usage
+*/
+uint8_t fat_print_cluster_stats(sdcard_t * sdcard)
+{
+	uint32_t free_clusters = 0;
+	uint32_t used_clusters = 0;
 	
-		cluster++;
+	if(!fat_statfs(sdcard, &free_clusters, &used_clusters))
+	{
+		return 0;
 	}
 	
-	printf("Used clusters: %ld\n", used_clusters);
-	printf("Free clusters: %ld\n", free_clusters);
+	printf("Used clusters: %lu\n", (unsigned long)used_clusters);
+	printf("Free clusters: %lu\n", (unsigned long)free_clusters);
 	
-	return 0;
+	return 1;
 }
 
 
@@ -343,20 +564,13 @@ uint8_t fat_read_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector)
 	uint32_t target_sector;
 	uint32_t i;
 	
-	if(sdcard->fattype == FAT16)
-	{
-		if(cluster >= 0xFFF8)
-			return 0;
-	}
-	else
-	{
-		cluster = cluster & 0x0FFFFFFF;
-		if(cluster >= 0x0FFFFFF8)
-			return 0;
-	}
+	cluster = fat_entry_cluster(sdcard, cluster);
+	
+	if(fat_entry_is_end(sdcard, cluster))
+		return 0;
 	
 	// Special case, FAT16 root directory
-	if(sdcard->fattype == FAT16 && cluster == 0)
+	if(FAT_IS_FAT16(sdcard) && cluster == 0)
 	{
 		if(sector >= sdcard->rootdir_sectors) return 0;
 		target_sector = sdcard->rootdir_begin_sector + sector;
@@ -365,7 +579,7 @@ uint8_t fat_read_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector)
 	else
 	{
 		// Check how many clusters we need to search ahead
-		cluster_offset = (sector / sdcard->sectors_per_cluster);
+		cluster_offset = (sector >> sdcard->cluster_shift);
 		
 		for(i=0; i<cluster_offset; i++)
 		{
@@ -381,7 +595,7 @@ uint8_t fat_read_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector)
 		
 		// Calculate which sector to read
 		target_sector = fat_get_cluster_sector(sdcard, cluster);
-		target_sector += (sector - (cluster_offset * sdcard->sectors_per_cluster));
+		target_sector += (sector & sdcard->cluster_mask);
 	}
 	
 	// Read the sector
@@ -412,17 +626,10 @@ uint8_t fat_write_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector, ui
 	uint32_t nextcluster;
 	uint32_t i;
 	
-	if(sdcard->fattype == FAT16)
-	{
-		if(cluster >= 0xFFF8)
-			return 0;
-	}
-	else
-	{
-		cluster = cluster & 0x0FFFFFFF;
-		if(cluster >= 0x0FFFFFF8)
-			return 0;
-	}
+	cluster = fat_entry_cluster(sdcard, cluster);
+	
+	if(fat_entry_is_end(sdcard, cluster))
+		return 0;
 	
 	// Copy the sd buffer to a temporary variable
 	// in case we need to perform a FAT table lookup which will
@@ -437,7 +644,7 @@ uint8_t fat_write_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector, ui
 	
 	
 	// Special case, FAT16 root directory
-	if(sdcard->fattype == FAT16 && cluster == 0)
+	if(FAT_IS_FAT16(sdcard) && cluster == 0)
 	{
 		if(sector >= sdcard->rootdir_sectors) return 0;
 		target_sector = sdcard->rootdir_begin_sector + sector;
@@ -446,7 +653,7 @@ uint8_t fat_write_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector, ui
 	else
 	{
 		// Check how many clusters we need to search ahead
-		cluster_offset = (sector / sdcard->sectors_per_cluster);
+		cluster_offset = (sector >> sdcard->cluster_shift);
 		
 		for(i=0; i<cluster_offset; i++)
 		{
@@ -484,7 +691,7 @@ uint8_t fat_write_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector, ui
 		
 		// Calculate which sector to write
 		target_sector = fat_get_cluster_sector(sdcard, cluster);
-		target_sector += (sector - (cluster_offset * sdcard->sectors_per_cluster));
+		target_sector += (sector & sdcard->cluster_mask);
 	}
 	
 	// Invalidate cached buffer
@@ -535,215 +742,367 @@ uint32_t fat_get_cluster_sector(sdcard_t *sdcard, uint32_t cluster_number)
 		cluster_number = 2;
 	}
 	
-	return (sdcard->data_begin_sector + ((cluster_number - 2) * sdcard->sectors_per_cluster));
+	return (sdcard->data_begin_sector + ((cluster_number - 2) << sdcard->cluster_shift));
 }
 
 
 /*******************************************************************
-* Free a cluster chain
+* Get the next cluster from the FAT table
 *
-* @param sdcard			SD Card structure
-* @param startcluster	The first cluster of the chain
+* @param sdcard			SD card structure
+* @param cluster			The cluster to look up
 *
 */
-uint8_t fat_free_cluster_chain(sdcard_t *sdcard, uint32_t startcluster, uint8_t cleardata)
+uint32_t fat_get_next_cluster(sdcard_t *sdcard, uint32_t cluster)
 {
-	uint32_t cluster;
-	uint32_t nextcluster;
-	uint32_t sector;
+	// Check cluster
+	cluster = fat_entry_cluster(sdcard, cluster);
 	
-	nextcluster = startcluster;
+	if(fat_entry_is_end(sdcard, cluster))
+		return 0xFFFFFFFF;
 	
-	while(nextcluster != 0xFFFFFFFF && nextcluster != 0)
-	{
-		cluster = nextcluster;
-		
-		// Find next
-		nextcluster = fat_get_next_cluster(sdcard, cluster);
-		
-		// Free cluster
-		fat_set_next_cluster(sdcard, cluster, 0);
-		
-		// Clear the actual data on the drive
-		if(cleardata)
-		{
-			sdcard->loaded_sector = -1;
-			memset(sdcard->buffer, 0x00, sdcard->blocksize);
-			
-			for(sector = 0; sector < sdcard->sectors_per_cluster; sector++)
-			{
-				if(!fat_write_sector(sdcard, cluster, sector, 0))
-				{
-				}
-			} 
-		}
-	}
+	// Out of data clusters
+	if(cluster > sdcard->data_clusters + 1) { return 0; }
+	// Read the sector within the FAT table
+	if(!sd_read_block(sdcard, fat_entry_sector(sdcard, cluster), 0)) { return 0; }
 	
-	return 1;
+	// Get the value
+	return fat_entry_get(sdcard, cluster);
 }
 
 
 /*******************************************************************
-* Get the next cluster from the FAT table
+* Set the next cluster in the FAT table
 *
 * @param sdcard			SD card structure
-* @param cluster			The cluster to look up
+* @param cluster			The cluster to read/write
+* @param nextcluster		The value to set
 *
 */
-uint32_t fat_get_next_cluster(sdcard_t *sdcard, uint32_t cluster)
+uint8_t fat_set_next_cluster(sdcard_t *sdcard, uint32_t cluster, uint32_t nextcluster)
 {
-	uint16_t *fat16val;
-	uint32_t *fat32val;
-	uint32_t value;
-	uint32_t sector = 0;
-	uint32_t offset = 0;
-
-	// Check cluster
-	if(sdcard->fattype == FAT16)
-	{
-		if(cluster > 0xFFF8)
-			return 0xFFFFFFFF;
-	}
-	else
-	{
-		cluster = cluster & 0x0FFFFFFF;
-		
-		if(cluster >= 0x0FFFFFF8)
-			return 0xFFFFFFFF;
-	}
+	// Sanity check
+	cluster = fat_entry_cluster(sdcard, cluster);
+	
+	if(fat_entry_is_end(sdcard, cluster))
+		return 0;
 	
-	// FAT16
-	if(sdcard->fattype == FAT16)
-	{
-		// Sector that contains the fat entry
-		sector = ((cluster * 2) / sdcard->blocksize);
-		// Offset from the start of the sector to the value we want
-		offset = ((cluster * 2) % sdcard->blocksize);
-	}
-	// FAT32
-	else
-	{
-		// Sector that contains the fat entry
-		sector = ((cluster * 4) / sdcard->blocksize);
-		// Offset from the start of the sector to the value we want
-		offset = ((cluster * 4) % sdcard->blocksize);
-	}
-
 	// Out of data clusters
 	if(cluster > sdcard->data_clusters + 1) { return 0; }
-	// Out of FAT sectors
-	if(sector > sdcard->fat_sectors) { return 0; }
 	// Read the sector within the FAT table
-	if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 0)) { return 0; }
+	if(!sd_read_block(sdcard, fat_entry_sector(sdcard, cluster), 0)) { return 0; }
 	
-	// Get the value
-	if(sdcard->fattype == FAT16)
+	// Set the new value
+	fat_entry_set(sdcard, cluster, nextcluster);
+	
+	// Write back
+	if(!sd_write_block(sdcard, fat_entry_sector(sdcard, cluster), 0))
+	{
+		return 0;
+	}
+	
+	return 1;
+}
+
+
+#if !defined(__AVR__)
+/* Host builds test several FAT entries per instruction */
+typedef uint32_t fat_vec32_t __attribute__((vector_size(16)));
+typedef int32_t fat_mask32_t __attribute__((vector_size(16)));
+typedef uint16_t fat_vec16_t __attribute__((vector_size(16)));
+typedef int16_t fat_mask16_t __attribute__((vector_size(16)));
+#endif
+
+/*******************************************************************
+* Count the free entries in the loaded FAT sector
+* FAT16 entries are tested two at a time as 32-bit words.
+*
+* @param sdcard		SD Card structure
+* @param first			First entry in the sector to check
+* @param last			One past the last entry to check
+*
+*/
+static uint16_t fat_count_free_entries(sdcard_t *sdcard, uint16_t first, uint16_t last)
+{
+	uint16_t count = 0;
+	uint16_t i = first;
+	uint32_t word;
+	
+	if(FAT_IS_FAT16(sdcard))
 	{
-		fat16val = (uint16_t *)&sdcard->buffer[offset];
-		value = *fat16val;
+		uint16_t *entry = (uint16_t *)sdcard->buffer;
+		
+		// Align to a pair of entries
+		if((i & 1) && i < last)
+		{
+			count += (entry[i] == 0);
+			i++;
+		}
+		
+#if !defined(__AVR__)
+		fat_vec16_t vec16;
+		fat_mask16_t free16;
+		fat_vec16_t zero16 = { 0 };
+		
+		for(; i + 8 <= last; i += 8)
+		{
+			memcpy(&vec16, &entry[i], sizeof(vec16));
+			free16 = (vec16 == zero16);
+			
+			// Lanes are -1 for free entries
+			count -= (free16[0] + free16[1] + free16[2] + free16[3] + free16[4] + free16[5] + free16[6] + free16[7]);
+		}
+#endif
 		
-		value = value & 0xFFFF;
+		for(; i + 2 <= last; i += 2)
+		{
+			word = *(uint32_t *)&entry[i];
+			
+			// Both entries free
+			if(word == 0)
+			{
+				count += 2;
+			}
+			else
+			{
+				count += ((word & 0xFFFF) == 0) + ((word >> 16) == 0);
+			}
+		}
 		
-		if(value >= 0xFFF8)
+		if(i < last)
 		{
-			value = 0xFFFFFFFF;
+			count += (entry[i] == 0);
 		}
 	}
 	else
 	{
-		fat32val = (uint32_t *)&sdcard->buffer[offset];
-		value = *fat32val;
+		uint32_t *entry = (uint32_t *)sdcard->buffer;
+		
+#if !defined(__AVR__)
+		fat_vec32_t vec32;
+		fat_mask32_t free32;
+		fat_vec32_t mask32 = { 0x0FFFFFFF, 0x0FFFFFFF, 0x0FFFFFFF, 0x0FFFFFFF };
+		fat_vec32_t zero32 = { 0 };
 		
-		value = value & 0x0FFFFFFF;
+		for(; i + 4 <= last; i += 4)
+		{
+			memcpy(&vec32, &entry[i], sizeof(vec32));
+			free32 = ((vec32 & mask32) == zero32);
+			
+			// Lanes are -1 for free entries
+			count -= (free32[0] + free32[1] + free32[2] + free32[3]);
+		}
+#endif
 		
-		if(value >= 0x0FFFFFF8)
+		for(; i < last; i++)
 		{
-			value = 0xFFFFFFFF;
+			count += ((entry[i] & 0x0FFFFFFF) == 0);
 		}
 	}
 	
-	return value;
+	return count;
 }
 
 
 /*******************************************************************
-* Set the next cluster in the FAT table
+* Find the first free or used entry in the loaded FAT sector
+* Stretches of used (or free) FAT16 entries are skipped two at a time.
 *
-* @param sdcard			SD card structure
-* @param cluster			The cluster to read/write
-* @param nextcluster		The value to set
+* @param sdcard		SD Card structure
+* @param first			First entry in the sector to check
+* @param last			One past the last entry to check
+* @param free			Look for a free entry, otherwise a used one
 *
+* @return Index of the entry, last if there is none
 */
-uint8_t fat_set_next_cluster(sdcard_t *sdcard, uint32_t cluster, uint32_t nextcluster)
+static uint16_t fat_find_table_entry(sdcard_t *sdcard, uint16_t first, uint16_t last, uint8_t free)
 {
-	uint16_t *fat16val;
-	uint32_t *fat32val;
-	uint32_t sector = 0;
-	uint32_t offset = 0;
-
-	// Sanity check
-	if(sdcard->fattype == FAT16)
+	uint16_t i = first;
+	uint32_t word;
+	
+	if(FAT_IS_FAT16(sdcard))
 	{
-		if(cluster > 0xFFF8)
-			return 0;
+		uint16_t *entry = (uint16_t *)sdcard->buffer;
+		
+		if((i & 1) && i < last)
+		{
+			if((entry[i] == 0) == free) return i;
+			i++;
+		}
+		
+		for(; i + 2 <= last; i += 2)
+		{
+			word = *(uint32_t *)&entry[i];
+			
+			// Skip pairs without a match
+			if(free ? ((word & 0xFFFF) != 0 && (word >> 16) != 0) : (word == 0))
+			{
+				continue;
+			}
+			
+			if((entry[i] == 0) == free) return i;
+			return i + 1;
+		}
+		
+		if(i < last && (entry[i] == 0) == free)
+		{
+			return i;
+		}
 	}
 	else
 	{
-		cluster = cluster & 0x0FFFFFFF;
+		uint32_t *entry = (uint32_t *)sdcard->buffer;
 		
-		if(cluster >= 0x0FFFFFF8)
-			return 0;
+		if(free)
+		{
+			for(; i < last; i++)
+			{
+				if((entry[i] & 0x0FFFFFFF) == 0) return i;
+			}
+		}
+		else
+		{
+			for(; i < last; i++)
+			{
+				if((entry[i] & 0x0FFFFFFF) != 0) return i;
+			}
+		}
 	}
 	
+	return last;
+}
+
+
+/*******************************************************************
+* Count the free and used clusters, one FAT sector at a time
+* The free cluster count in the sdcard structure is updated.
+*
+* @param sdcard		SD Card structure
+* @param free_clusters	Set to the number of free clusters
+* @param used_clusters	Set to the number of used clusters
+*
+*/
+uint8_t fat_statfs(sdcard_t * sdcard, uint32_t *free_clusters, uint32_t *used_clusters)
+{
+	uint32_t sector;
+	uint32_t cluster;
+	uint32_t lastcluster;
+	uint16_t entries;
+	uint16_t first;
+	uint16_t last;
+	uint32_t count = 0;
+	
+	entries = sdcard->entry_mask + 1;
+	lastcluster = sdcard->data_clusters + 1;
 	
-	// FAT16
-	if(sdcard->fattype == FAT16)
+	for(sector = 0, cluster = 0; cluster <= lastcluster && sector < sdcard->fat_sectors; sector++, cluster += entries)
 	{
-		// Sector that contains the fat entry
-		sector = ((cluster * 2) / sdcard->blocksize);
-		// Offset from the start of the sector to the value we want
-		offset = ((cluster * 2) % sdcard->blocksize);
+		if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 0))
+		{
+			return 0;
+		}
+		
+		// The first two entries are reserved
+		first = (sector == 0 ? 2 : 0);
+		last = ((lastcluster - cluster) < entries ? (lastcluster - cluster + 1) : entries);
+		
+		count += fat_count_free_entries(sdcard, first, last);
 	}
-	// FAT32
-	else
+	
+	*free_clusters = count;
+	*used_clusters = sdcard->data_clusters - count;
+	
+	if(sdcard->free_clusters != count)
 	{
-		// Sector that contains the fat entry
-		sector = ((cluster * 4) / sdcard->blocksize);
-		// Offset from the start of the sector to the value we want
-		offset = ((cluster * 4) % sdcard->blocksize);
+		sdcard->free_clusters = count;
+		sdcard->fsinfo_dirty = 1;
 	}
+	
+	return 1;
+}
 
-	// Out of data clusters
-	if(cluster > sdcard->data_clusters + 1) { return 0; }
-	// Out of FAT sectors
-	if(sector > sdcard->fat_sectors) { return 0; }
-	// Read the sector within the FAT table
-	if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 0)) { return 0; }
+
+/*******************************************************************
+* Continue counting the free clusters while the free count is unknown
+* At most "budget" FAT sectors are read, the count is complete when
+* the last FAT sector has been counted. Clusters allocated or freed
+* in the part already counted are corrected by the bookkeeping
+* functions, so the count stays valid between the steps.
+* Returns the number of FAT sectors read.
+*
+* @param sdcard		SD Card structure
+* @param budget		Maximum number of FAT sectors to read
+*
+*/
+static uint8_t fat_count_free_step(sdcard_t * sdcard, uint8_t budget)
+{
+	uint32_t cluster;
+	uint32_t lastcluster;
+	uint16_t entries;
+	uint16_t first;
+	uint16_t last;
+	uint8_t used = 0;
 	
-	// Set the new value
-	if(sdcard->fattype == FAT16)
-	{
-		fat16val = (uint16_t *)&sdcard->buffer[offset];
-		*fat16val = (uint16_t)nextcluster;
-	}
-	else
+	entries = sdcard->entry_mask + 1;
+	lastcluster = sdcard->data_clusters + 1;
+	
+	while(used < budget && sdcard->free_clusters == 0xFFFFFFFF)
 	{
-		fat32val = (uint32_t *)&sdcard->buffer[offset];
-		*fat32val = nextcluster;
+		cluster = sdcard->free_scan_sector << sdcard->entry_shift;
+		
+		// Done, the count replaces the unknown value
+		if(cluster > lastcluster || sdcard->free_scan_sector >= sdcard->fat_sectors)
+		{
+			sdcard->free_clusters = sdcard->free_scan_count;
+			sdcard->fsinfo_dirty = 1;
+			break;
+		}
+		
+		if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sdcard->free_scan_sector), 0))
+		{
+			break;
+		}
+		
+		used++;
+		
+		first = (sdcard->free_scan_sector == 0 ? 2 : 0);
+		last = ((lastcluster - cluster) < entries ? (lastcluster - cluster + 1) : entries);
+		
+		sdcard->free_scan_count += fat_count_free_entries(sdcard, first, last);
+		sdcard->free_scan_sector++;
 	}
 	
-	// Write back
-	if(!sd_write_block(sdcard, (sdcard->fat_begin_sector + sector), 0))
+	return used;
+}
+
+
+/*******************************************************************
+* Free space in bytes, without reading the card
+* Returns 0 while the free cluster count is still unknown, call
+* fat_idle_work() until it is known.
+*
+* @param sdcard		SD Card structure
+* @param bytes			Set to the number of free bytes
+*
+*/
+uint8_t fat_free_bytes(sdcard_t * sdcard, uint64_t *bytes)
+{
+	if(sdcard->fattype == 0 || sdcard->free_clusters == 0xFFFFFFFF)
 	{
 		return 0;
 	}
 	
+	*bytes = ((uint64_t)sdcard->free_clusters << sdcard->cluster_shift) << sdcard->sector_shift;
+	
 	return 1;
 }
 
 
 /*******************************************************************
 * Get the next free cluster
+* The FAT is searched one sector at a time, and the search wraps
+* around to the start of the FAT when it reaches the end, so every
+* cluster is checked once.
 *
 * @param sdcard		SD Card structure
 * @param cluster		Cluster to start looking from
@@ -751,85 +1110,65 @@ uint8_t fat_set_next_cluster(sdcard_t *sdcard, uint32_t cluster, uint32_t nextcl
 */
 uint32_t fat_get_next_free_cluster(sdcard_t *sdcard, uint32_t cluster)
 {
-	uint16_t *fat16val;
-	uint32_t *fat32val;
-	uint32_t value;
-	uint32_t sector = 0;
-	uint32_t offset = 0;
+	uint32_t sector;
+	uint32_t base;
+	uint32_t lastcluster;
+	uint16_t entries;
+	uint16_t first;
+	uint16_t last;
+	uint16_t found;
+	uint32_t startcluster;
+	uint8_t pass;
 	
 	// Sanity check
-	if(sdcard->fattype == FAT16)
-	{
-		if(cluster > 0xFFF8)
-			return 0;
-	}
-	else
-	{
-		cluster = cluster & 0x0FFFFFFF;
-		
-		if(cluster >= 0x0FFFFFF8)
-			return 0;
-	}
-	
+	cluster = fat_entry_cluster(sdcard, cluster);
 	
-	while(1)
-	{
-		// FAT16
-		if(sdcard->fattype == FAT16)
-		{
-			// Sector that contains the fat entry
-			sector = ((cluster * 2) / sdcard->blocksize);
-			// Offset from the start of the sector to the value we want
-			offset = ((cluster * 2) % sdcard->blocksize);
-		}
-		// FAT32
-		else
-		{
-			// Sector that contains the fat entry
-			sector = ((cluster * 4) / sdcard->blocksize);
-			// Offset from the start of the sector to the value we want
-			offset = ((cluster * 4) % sdcard->blocksize);
-		}
+	if(fat_entry_is_end(sdcard, cluster))
+		return 0;
 	
-		// Out of data clusters
-		if(cluster > sdcard->data_clusters + 1) { break; }
-		// Out of FAT sectors
-		if(sector > sdcard->fat_sectors) { return 0; }
+	entries = sdcard->entry_mask + 1;
+	lastcluster = sdcard->data_clusters + 1;
 	
-		// Read the sector
-		if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 1))
-		{
-			return 0;
-		}
+	// First two entries are reserved
+	if(cluster < 2 || cluster > lastcluster)
+	{
+		cluster = 2;
+	}
 	
-		//printf("Sector:        %ld\n", sector);
-		//printf("Offset:        %ld\n", offset);
+	startcluster = cluster;
 	
-		// Get the value
-		if(sdcard->fattype == FAT16)
-		{
-			fat16val = (uint16_t *)&sdcard->buffer[offset];
-			value = *fat16val;
-		}
-		else
+	// From the start cluster to the end, then from the start of the FAT
+	for(pass = 0; pass < 2; pass++)
+	{
+		while(cluster <= lastcluster && (pass == 0 || cluster < startcluster))
 		{
-			fat32val = (uint32_t *)&sdcard->buffer[offset];
-			value = *fat32val;
+			sector = cluster >> sdcard->entry_shift;
+			base = sector << sdcard->entry_shift;
+			
+			// Out of FAT sectors
+			if(sector >= sdcard->fat_sectors) { break; }
+			
+			// Read the sector
+			if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 0))
+			{
+				return 0;
+			}
+			
+			first = cluster - base;
+			last = ((lastcluster - base) < entries ? (lastcluster - base + 1) : entries);
+			
+			found = fat_find_table_entry(sdcard, first, last, 1);
+			
+			// We have found a free entry
+			if(found < last)
+			{
+				return base + found;
+			}
+			
+			cluster = base + entries;
 		}
 		
-		//printf("Table val:     %ld\n", value);
-		
-		// We have found a free entry
-		if(value == 0)
-		{
-			printf("Found free cluster: %ld\n", cluster);
-			printf("Sector:        %ld\n", sector);
-			printf("Offset:        %ld\n", offset);
-			printf("Table val:     %ld\n", value);
-			return cluster;
-		}
-	
-		cluster++;
+		cluster = 2;
 	}
 	
 	return 0;
@@ -837,169 +1176,225 @@ uint32_t fat_get_next_free_cluster(sdcard_t *sdcard, uint32_t cluster)
 
 
 /*******************************************************************
-* Allocate a new cluster for a chain
+* Write back a modified FAT sector held in the buffer
 *
 * @param sdcard		SD Card structure
-* @param cluster		Cluster to allocate for
+* @param dirty			FAT sector waiting to be written, 0 if none
 *
 */
-uint32_t fat_allocate_cluster(sdcard_t *sdcard, uint32_t cluster)
+static uint8_t fat_flush_table_sector(sdcard_t *sdcard, uint32_t *dirty)
 {
-	uint32_t nextcluster;
-	
-	nextcluster = fat_get_next_free_cluster(sdcard, cluster);
-	if(!nextcluster)
+	if(*dirty == 0)
 	{
-		return 0;
+		return 1;
 	}
 	
-	if(!fat_set_next_cluster(sdcard, cluster, nextcluster))
+	if(!sd_write_block(sdcard, *dirty, 0))
 	{
 		return 0;
 	}
 	
-	// Mark the new cluster as end of chain
-	if(!fat_set_next_cluster(sdcard, nextcluster, 0xFFFFFFFF))
+	*dirty = 0;
+	return 1;
+}
+
+
+/*******************************************************************
+* Load the FAT sector that holds the entry for a cluster into the
+* buffer. A modified FAT sector still waiting in the buffer is written
+* back first.
+*
+* @param sdcard		SD Card structure
+* @param cluster		Cluster whose entry is needed
+* @param dirty			FAT sector waiting to be written, 0 if none
+*
+*/
+static uint8_t fat_load_table_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t *dirty)
+{
+	uint32_t sector;
+	
+	sector = fat_entry_sector(sdcard, cluster);
+	
+	// Write back the previous sector before it is replaced
+	if(*dirty != 0 && *dirty != sector)
 	{
-		return 0;
+		if(!fat_flush_table_sector(sdcard, dirty))
+		{
+			return 0;
+		}
 	}
 	
-	return nextcluster;
+	return sd_read_block(sdcard, sector, 0);
 }
 
 
+/*******************************************************************
+* Set the FAT entry for a cluster in the loaded FAT sector and mark
+* the sector as waiting to be written
+*/
+static void fat_table_set(sdcard_t *sdcard, uint32_t cluster, uint32_t value, uint32_t *dirty)
+{
+	fat_entry_set(sdcard, cluster, value);
+	*dirty = fat_entry_sector(sdcard, cluster);
+}
+
 
 /*******************************************************************
-* Find a specific file or directory by longname
+* Release a cluster chain. Every FAT sector is read once, all links
+* of the chain within it are cleared and it is written once.
 *
 * @param sdcard			SD Card structure
-* @param startcluster	The cluster to start searching from
-* @param filename			Longname of the file/dir to find
+* @param startcluster	The first cluster of the chain
+* @param keepfirst		Keep the first cluster as a one cluster chain
 *
 */
-dir_short_t * fat_find_lfn(sdcard_t *sdcard, uint32_t startcluster, const char * filename)
+static uint8_t fat_release_chain(sdcard_t *sdcard, uint32_t startcluster, uint8_t keepfirst)
 {
+	uint32_t dirty = 0;
 	uint32_t cluster;
-	uint32_t sector;
-	uint32_t entry;
-	dir_short_t *dir;
-	lfn_cache lfn;
-
-	lfn_cache_reset(&lfn);
+	uint32_t nextcluster;
 	
-	// Start cluster
 	cluster = startcluster;
-	sector = 0;
 	
-	while(1)
+	while(cluster >= 2 && cluster <= sdcard->data_clusters + 1)
 	{
-		printf("Reading cluster: %ld -> %ld\n", cluster, sector);
-		if(!fat_read_sector(sdcard, cluster, sector))
+		if(!fat_load_table_sector(sdcard, cluster, &dirty))
 		{
 			return 0;
 		}
-				
-		//
-		// Loop directory entries in this sector
-		//
-		for(entry = 0; entry < 16; entry++)
+		
+		nextcluster = fat_entry_get(sdcard, cluster);
+		
+		// Already free, broken chain
+		if(nextcluster == 0)
 		{
-			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
-			
-			// Last entry
-			if(fat_is_last_entry(dir)) { return 0; }			
-			// Free entry
-			if(fat_is_free_entry(dir)) { lfn_cache_reset(&lfn); continue; }
-			
-			// Long name entry
-			if(fat_is_lfn_entry(dir))
-			{
-				lfn_cache_add(&lfn, dir);
-				continue;
-			}
-			
-			// Directory or file entry
-			if(fat_is_sfn_entry(dir))
-			{
-				// Compare
-				if(lfn.strings > 0)
-				{
-					if(lfn_cache_compare(&lfn, filename))
-					{
-						return dir;
-					}
-				}
-				
-				lfn_cache_reset(&lfn);				
-				continue;
-			}
+			break;
 		}
-
-		// Increment sector
-		sector++;
+		
+		if(keepfirst && cluster == startcluster)
+		{
+			fat_table_set(sdcard, cluster, 0x0FFFFFFF, &dirty);
+		}
+		else
+		{
+			fat_table_set(sdcard, cluster, 0, &dirty);
+			fat_cluster_freed(sdcard, cluster);
+		}
+		
+		cluster = nextcluster;
 	}
 	
-	//printf("End of function\n");
-	return 0;
+	return fat_flush_table_sector(sdcard, &dirty);
 }
 
 
 /*******************************************************************
-* Find a specific file or directory by shortname
-* Used to know what the next free tail number is when creating files
+* Overwrite a run of clusters with zeros, with one write command
 *
 * @param sdcard			SD Card structure
-* @param startcluster	The cluster to start searching from
-* @param filename			Shortname of the file/dir to find
+* @param first			The first cluster of the run
+* @param count			Number of clusters
 *
 */
-dir_short_t * fat_find_sfn(sdcard_t *sdcard, uint32_t startcluster, const char * filename)
+static uint8_t fat_clear_clusters(sdcard_t *sdcard, uint32_t first, uint32_t count)
+{
+	// The buffer no longer holds the last sector read
+	sdcard->loaded_sector = -1;
+	memset(sdcard->buffer, 0x00, sdcard->blocksize);
+	
+	return sd_write_blocks(sdcard, fat_get_cluster_sector(sdcard, first), (count << sdcard->cluster_shift));
+}
+
+
+/*******************************************************************
+* Overwrite the data of every cluster in a chain with zeros
+* Each contiguous run of the chain is cleared with one write command.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The first cluster of the chain
+*
+*/
+static uint8_t fat_clear_chain_data(sdcard_t *sdcard, uint32_t startcluster)
 {
 	uint32_t cluster;
-	uint32_t sector;
-	uint32_t entry;
-	dir_short_t *dir;
+	uint32_t nextcluster;
+	uint32_t first;
+	uint32_t count;
 	
-	// Start cluster
 	cluster = startcluster;
-	sector = 0;
 	
-	while(1)
+	while(cluster != 0xFFFFFFFF && cluster != 0)
 	{
-		printf("Reading cluster: %ld -> %ld\n", cluster, sector);
-		if(!fat_read_sector(sdcard, cluster, sector))
+		first = cluster;
+		count = 1;
+		
+		while((nextcluster = fat_get_next_cluster(sdcard, cluster)) == cluster + 1)
+		{
+			cluster = nextcluster;
+			count++;
+		}
+		
+		if(!fat_clear_clusters(sdcard, first, count))
 		{
 			return 0;
 		}
-				
-		//
-		// Loop directory entries in this sector
-		//
-		for(entry = 0; entry < 16; entry++)
+		
+		cluster = nextcluster;
+	}
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Free a cluster chain
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The first cluster of the chain
+* @param cleardata		Overwrite the cluster data with zeros first
+*
+*/
+uint8_t fat_free_cluster_chain(sdcard_t *sdcard, uint32_t startcluster, uint8_t cleardata)
+{
+	// Clear the actual data on the drive
+	if(cleardata)
+	{
+		fat_clear_chain_data(sdcard, startcluster);
+	}
+	
+	return fat_release_chain(sdcard, startcluster, 0);
+}
+
+
+/*******************************************************************
+* Take the first cluster from the free cluster ring
+* Entries are checked against the FAT, clusters allocated by other
+* means since the ring was filled are dropped.
+* Returns 0 if the ring holds no free cluster.
+*
+* @param sdcard		SD Card structure
+*
+*/
+static uint32_t fat_ring_pop(sdcard_t *sdcard)
+{
+	uint32_t dirty = 0;
+	uint32_t cluster;
+	
+	while(sdcard->free_ring_count > 0)
+	{
+		cluster = sdcard->free_ring[sdcard->free_ring_head];
+		sdcard->free_ring_head = (sdcard->free_ring_head + 1) % FAT_FREE_RING_SIZE;
+		sdcard->free_ring_count--;
+		
+		if(!fat_load_table_sector(sdcard, cluster, &dirty))
 		{
-			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
-			
-			// Last entry
-			if(fat_is_last_entry(dir)) { return 0; }			
-			// Free entry
-			if(fat_is_free_entry(dir)) { continue; }
-			// Long name entry
-			if(fat_is_lfn_entry(dir)) { continue; }
-			
-			// Directory or file entry
-			if(fat_is_sfn_entry(dir))
-			{
-				if(sfn_compare((char*)dir->DIR_Name, filename))
-				{
-					return dir;
-				}
+			return 0;
+		}
 		
-				continue;
-			}
+		if(fat_entry_get(sdcard, cluster) == 0)
+		{
+			return cluster;
 		}
-
-		// Increment sector
-		sector++;
 	}
 	
 	return 0;
@@ -1007,384 +1402,2941 @@ dir_short_t * fat_find_sfn(sdcard_t *sdcard, uint32_t startcluster, const char *
 
 
 /*******************************************************************
-* Find the first free entry that can contain "entries" number
-* of consecutive free entries
+* Put a cluster taken with fat_ring_pop() back in front of the ring
 *
-* @param sdcard			SD Card structure
-* @param startcluster	Cluster to start looking from
-* @param entries			Number of entries needed
+* @param sdcard		SD Card structure
+* @param cluster		Free cluster
 *
-* @return dir_short_t * or 0 if none found
 */
-fat_entry * fat_find_free_entry(sdcard_t *sdcard, uint32_t startcluster, uint8_t entries)
+static void fat_ring_unpop(sdcard_t *sdcard, uint32_t cluster)
+{
+	sdcard->free_ring_head = (sdcard->free_ring_head + FAT_FREE_RING_SIZE - 1) % FAT_FREE_RING_SIZE;
+	sdcard->free_ring[sdcard->free_ring_head] = cluster;
+	sdcard->free_ring_count++;
+}
+
+
+/*******************************************************************
+* Allocate clusters from the free cluster ring and append them to a
+* chain, see fat_allocate_clusters(). No FAT search is done, so the
+* time taken only depends on count. Fails without changing anything
+* if the ring does not hold enough free clusters.
+*
+* @param sdcard		SD Card structure
+* @param lastcluster	Last cluster of the chain to extend, 0 for a new chain
+* @param count			Number of clusters to allocate
+* @param first			First allocated cluster
+* @param last			Last allocated cluster
+*
+*/
+static uint8_t fat_ring_allocate(sdcard_t *sdcard, uint32_t lastcluster, uint32_t count, uint32_t *first, uint32_t *last)
+{
+	uint32_t clusters[FAT_FREE_RING_SIZE];
+	uint32_t dirty = 0;
+	uint32_t nextcluster;
+	uint32_t taken;
+	
+	if(count == 0 || count > sdcard->free_ring_count)
+	{
+		return 0;
+	}
+	
+	for(taken = 0; taken < count; taken++)
+	{
+		clusters[taken] = fat_ring_pop(sdcard);
+		
+		if(clusters[taken] == 0)
+		{
+			break;
+		}
+	}
+	
+	// Not enough, return the ones taken
+	if(taken < count)
+	{
+		while(taken > 0)
+		{
+			fat_ring_unpop(sdcard, clusters[--taken]);
+		}
+		
+		return 0;
+	}
+	
+	// Link backwards, the ring is in ascending order
+	nextcluster = 0x0FFFFFFF;
+	
+	while(taken > 0)
+	{
+		taken--;
+		
+		if(!fat_load_table_sector(sdcard, clusters[taken], &dirty))
+		{
+			return 0;
+		}
+		
+		fat_table_set(sdcard, clusters[taken], nextcluster, &dirty);
+		fat_cluster_allocated(sdcard, clusters[taken]);
+		
+		nextcluster = clusters[taken];
+	}
+	
+	// Append to the existing chain
+	if(lastcluster != 0)
+	{
+		if(!fat_load_table_sector(sdcard, lastcluster, &dirty))
+		{
+			return 0;
+		}
+		
+		fat_table_set(sdcard, lastcluster, nextcluster, &dirty);
+	}
+	
+	*first = clusters[0];
+	*last = clusters[count - 1];
+	
+	return fat_flush_table_sector(sdcard, &dirty);
+}
+
+
+/*******************************************************************
+* Check that every cluster from start up to end (exclusive) is free
+* Returns 0 at the first used cluster or if the FAT can not be read.
+*
+* @param sdcard		SD Card structure
+* @param start		First cluster to check
+* @param end			Cluster after the last one to check
+*
+*/
+static uint8_t fat_range_is_free(sdcard_t *sdcard, uint32_t start, uint32_t end)
 {
+	uint32_t cluster;
 	uint32_t sector;
-	uint8_t entry;
-	uint8_t count;
-	fat_entry * firstentry;
-	dir_short_t *dir;
+	uint32_t base;
+	uint16_t entries;
+	uint16_t first;
+	uint16_t last;
 	
-	if(entries < 1)
+	entries = sdcard->entry_mask + 1;
+	
+	if(end > sdcard->data_clusters + 2)
 	{
-		return NULL;
+		return 0;
 	}
 	
-	firstentry = malloc(sizeof(fat_entry));
-	if(firstentry == NULL)
+	for(cluster = start; cluster < end; cluster = base + last)
 	{
-		return NULL;
+		sector = cluster >> sdcard->entry_shift;
+		base = sector << sdcard->entry_shift;
+		
+		if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 0))
+		{
+			return 0;
+		}
+		
+		first = cluster - base;
+		last = ((end - base) < entries ? (end - base) : entries);
+		
+		if(fat_find_table_entry(sdcard, first, last, 0) < last)
+		{
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Find an allocation unit where every cluster is free, starting with
+* the AU holding the allocation hint. At most FAT_AU_SEARCH_UNITS
+* units are checked, a used entry ends the check of its unit.
+* Returns the first cluster of the unit, 0 if none was found.
+*
+* @param sdcard		SD Card structure
+*
+*/
+static uint32_t fat_find_free_au(sdcard_t *sdcard)
+{
+	uint32_t units;
+	uint32_t unit;
+	uint32_t tries;
+	uint32_t start;
+	
+	if(sdcard->au_clusters == 0 || sdcard->au_first_cluster > sdcard->data_clusters + 1)
+	{
+		return 0;
+	}
+	
+	// Only whole units
+	units = (sdcard->data_clusters + 2 - sdcard->au_first_cluster) / sdcard->au_clusters;
+	
+	if(units == 0)
+	{
+		return 0;
+	}
+	
+	unit = 0;
+	if(sdcard->next_free_cluster > sdcard->au_first_cluster)
+	{
+		unit = (sdcard->next_free_cluster - sdcard->au_first_cluster) / sdcard->au_clusters;
+	}
+	
+	for(tries = 0; tries < units && tries < FAT_AU_SEARCH_UNITS; tries++, unit++)
+	{
+		if(unit >= units)
+		{
+			unit = 0;
+		}
+		
+		start = sdcard->au_first_cluster + unit * sdcard->au_clusters;
+		
+		// A used entry, try the next unit
+		if(fat_range_is_free(sdcard, start, start + sdcard->au_clusters))
+		{
+			return start;
+		}
+	}
+	
+	return 0;
+}
+
+
+/*******************************************************************
+* Get the cluster to start a free cluster search from
+* Aligned allocations start in an empty allocation unit and growing
+* chains continue after their last cluster while the unit has room
+* for the request, so a large file is written to whole AUs
+* sequentially.
+* Small allocations and cards without AU information use the
+* allocation hint, so small files and directories fill partly used
+* units instead of taking a new one each.
+*
+* @param sdcard		SD Card structure
+* @param lastcluster	Last cluster of the chain to extend, 0 for a new chain
+* @param count			Number of clusters needed
+* @param aligned		Large or preallocated allocation, start in an empty AU
+*
+*/
+static uint32_t fat_get_allocation_start(sdcard_t *sdcard, uint32_t lastcluster, uint32_t count, uint8_t aligned)
+{
+	uint32_t cluster;
+	uint32_t end;
+	
+	if(!aligned || sdcard->au_clusters == 0)
+	{
+		return sdcard->next_free_cluster;
+	}
+	
+	// Still inside the allocation unit of the chain, the request has to
+	// fit into free clusters of the unit or it would spill into others
+	if(lastcluster != 0 && lastcluster + 1 > sdcard->au_first_cluster &&
+		((lastcluster + 1 - sdcard->au_first_cluster) % sdcard->au_clusters) != 0)
+	{
+		end = lastcluster + 1 + sdcard->au_clusters - ((lastcluster + 1 - sdcard->au_first_cluster) % sdcard->au_clusters);
+		
+		if(end - (lastcluster + 1) >= count && fat_range_is_free(sdcard, lastcluster + 1, lastcluster + 1 + count))
+		{
+			return lastcluster + 1;
+		}
+	}
+	
+	cluster = fat_find_free_au(sdcard);
+	
+	if(cluster == 0)
+	{
+		return (lastcluster != 0 ? lastcluster + 1 : sdcard->next_free_cluster);
+	}
+	
+	return cluster;
+}
+
+
+/*******************************************************************
+* Background work, call this when there is time to spare
+* While the free cluster count is unknown the budget is used to count
+* it, see fat_free_bytes().
+* Refills the free cluster ring by checking at most "budget" FAT
+* sectors, so allocations done by fat_fwrite() can be taken from the
+* ring without searching the FAT. The refill starts where new files
+* would be allocated and continues in ascending order.
+* Returns the number of clusters in the ring.
+*
+* @param sdcard		SD Card structure
+* @param budget		Maximum number of FAT sectors to read
+*
+*/
+uint8_t fat_idle_work(sdcard_t *sdcard, uint8_t budget)
+{
+	uint32_t cluster;
+	uint32_t sector;
+	uint32_t base;
+	uint32_t lastcluster;
+	uint16_t entries;
+	uint16_t index;
+	uint16_t end;
+	
+	// No filesystem
+	if(sdcard->fattype == 0)
+	{
+		return 0;
+	}
+	
+	// Free space first
+	if(sdcard->free_clusters == 0xFFFFFFFF)
+	{
+		budget -= fat_count_free_step(sdcard, budget);
+	}
+	
+	// Restart only when the ring is empty, keeps the ring in order
+	if(sdcard->free_ring_scan == 0)
+	{
+		if(sdcard->free_ring_count != 0)
+		{
+			return sdcard->free_ring_count;
+		}
+		
+		sdcard->free_ring_scan = fat_get_allocation_start(sdcard, 0, 1, 0);
+	}
+	
+	entries = sdcard->entry_mask + 1;
+	lastcluster = sdcard->data_clusters + 1;
+	cluster = sdcard->free_ring_scan;
+	
+	if(cluster < 2 || cluster > lastcluster)
+	{
+		cluster = 2;
+	}
+	
+	while(budget > 0 && sdcard->free_ring_count < FAT_FREE_RING_SIZE)
+	{
+		budget--;
+		
+		sector = cluster >> sdcard->entry_shift;
+		base = sector << sdcard->entry_shift;
+		
+		if(sector >= sdcard->fat_sectors || !sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 0))
+		{
+			cluster = 0;
+			break;
+		}
+		
+		index = cluster - base;
+		end = ((lastcluster - base) < entries ? (lastcluster - base + 1) : entries);
+		
+		while(index < end && sdcard->free_ring_count < FAT_FREE_RING_SIZE)
+		{
+			index = fat_find_table_entry(sdcard, index, end, 1);
+			
+			if(index == end)
+			{
+				break;
+			}
+			
+			sdcard->free_ring[(sdcard->free_ring_head + sdcard->free_ring_count) % FAT_FREE_RING_SIZE] = base + index;
+			sdcard->free_ring_count++;
+			index++;
+		}
+		
+		cluster = base + index;
+		
+		// End of the FAT
+		if(cluster > lastcluster)
+		{
+			cluster = 0;
+			break;
+		}
+	}
+	
+	sdcard->free_ring_scan = cluster;
+	
+	return sdcard->free_ring_count;
+}
+
+
+/*******************************************************************
+* Find a range of clusters holding "count" free clusters, starting
+* from the given cluster. A contiguous run is preferred, the first
+* "count" free clusters are used if no run is found within
+* FAT_ALLOC_SEARCH_SECTORS further FAT sectors. Every free cluster
+* between first and last belongs to the result. After the end of the
+* FAT the search wraps to its start and stops at the starting cluster,
+* free clusters found on both sides of it are joined.
+*
+* @param sdcard		SD Card structure
+* @param cluster		Cluster to start searching from
+* @param count			Number of free clusters needed
+* @param contiguous	Only accept a contiguous run
+* @param first			First cluster of the range
+* @param last			Last cluster of the range
+*
+*/
+static uint8_t fat_find_free_range(sdcard_t *sdcard, uint32_t cluster, uint32_t count, uint8_t contiguous, uint32_t *first, uint32_t *last)
+{
+	uint32_t sector;
+	uint32_t base;
+	uint32_t lastcluster;
+	uint32_t runstart = 0;
+	uint32_t runlength;
+	uint32_t fitfirst = 0;
+	uint32_t fitlast = 0;
+	uint32_t fitcount;
+	uint32_t fitsector = 0;
+	uint32_t take;
+	uint32_t start;
+	uint32_t stop;
+	uint32_t headrun = 0;
+	uint32_t freeahead = 0;
+	uint16_t entries;
+	uint16_t index;
+	uint16_t end;
+	uint16_t used;
+	uint8_t pass;
+	
+	entries = sdcard->entry_mask + 1;
+	lastcluster = sdcard->data_clusters + 1;
+	
+	if(cluster < 2 || cluster > lastcluster)
+	{
+		cluster = 2;
+	}
+	
+	start = cluster;
+	runlength = 0;
+	fitcount = 0;
+	
+	// Search from the hint to the end, then from the start of the FAT
+	// up to the hint. The last pass continues after the hint when the
+	// first free clusters from the start of the FAT are not enough.
+	for(pass = 0; pass < 3; pass++)
+	{
+		if(pass == 0)
+		{
+			stop = lastcluster;
+		}
+		else if(pass == 1)
+		{
+			// Every free cluster after the hint was counted
+			freeahead = fitcount;
+			runlength = 0;
+			fitcount = 0;
+			cluster = 2;
+			stop = start - 1;
+		}
+		else
+		{
+			if(contiguous || fitcount + freeahead < count)
+			{
+				break;
+			}
+			
+			cluster = start;
+			stop = lastcluster;
+		}
+		
+		while(cluster <= stop)
+		{
+			sector = cluster >> sdcard->entry_shift;
+			base = sector << sdcard->entry_shift;
+			
+			// Give up looking for a contiguous run
+			if(!contiguous && fitcount == count && runlength == 0 && (sector - fitsector) >= FAT_ALLOC_SEARCH_SECTORS)
+			{
+				break;
+			}
+			
+			if(sector >= sdcard->fat_sectors)
+			{
+				break;
+			}
+			
+			if(!sd_read_block(sdcard, (sdcard->fat_begin_sector + sector), 0))
+			{
+				return 0;
+			}
+			
+			index = cluster - base;
+			end = ((stop - base) < entries ? (stop - base + 1) : entries);
+			
+			while(index < end)
+			{
+				// Skip used entries to the start of the next run
+				if(runlength == 0)
+				{
+					index = fat_find_table_entry(sdcard, index, end, 1);
+					
+					if(index == end)
+					{
+						break;
+					}
+					
+					runstart = base + index;
+				}
+				
+				// Free entries from index up to the next used one
+				used = fat_find_table_entry(sdcard, index, end, 0);
+				
+				// First free clusters, used if there is no contiguous run
+				if(fitcount < count && used > index)
+				{
+					if(fitcount == 0)
+					{
+						fitfirst = base + index;
+					}
+					
+					take = count - fitcount;
+					if(take > (uint32_t)(used - index))
+					{
+						take = used - index;
+					}
+					
+					fitcount += take;
+					
+					if(fitcount == count)
+					{
+						fitlast = base + index + take - 1;
+						fitsector = sector;
+					}
+				}
+				
+				runlength += (used - index);
+				
+				// Contiguous run found
+				if(runlength >= count)
+				{
+					*first = runstart;
+					*last = runstart + count - 1;
+					return 1;
+				}
+				
+				// The run is broken
+				if(used < end)
+				{
+					// Free clusters starting at the hint
+					if(pass == 0 && runstart == start)
+					{
+						headrun = runlength;
+					}
+					
+					runlength = 0;
+				}
+				
+				index = used;
+			}
+			
+			cluster = base + entries;
+		}
+		
+		// The run reaching the end of the pass
+		if(pass == 0 && runlength > 0 && runstart == start)
+		{
+			headrun = runlength;
+		}
+		
+		// A run before the hint that continues after it
+		if(pass == 1 && runlength > 0 && runlength + headrun >= count)
+		{
+			*first = runstart;
+			*last = runstart + count - 1;
+			return 1;
+		}
+		
+		if(!contiguous && fitcount == count)
+		{
+			*first = fitfirst;
+			*last = fitlast;
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+
+/*******************************************************************
+* Link every free cluster between first and last into a chain and
+* append it to lastcluster. The FAT is walked backwards so each
+* cluster can point at the one found before it, and every FAT sector
+* is read and written once.
+*
+* @param sdcard		SD Card structure
+* @param lastcluster	Last cluster of the existing chain, 0 for a new chain
+* @param first			First cluster of the range
+* @param last			Last cluster of the range
+* @param count			Number of clusters to link
+*
+*/
+static uint8_t fat_link_free_range(sdcard_t *sdcard, uint32_t lastcluster, uint32_t first, uint32_t last, uint32_t count)
+{
+	uint32_t dirty = 0;
+	uint32_t cluster;
+	uint32_t nextcluster;
+	uint32_t linked;
+	
+	nextcluster = 0x0FFFFFFF;
+	linked = 0;
+	
+	for(cluster = last; cluster >= first && linked < count; cluster--)
+	{
+		if(!fat_load_table_sector(sdcard, cluster, &dirty))
+		{
+			return 0;
+		}
+		
+		if(fat_entry_get(sdcard, cluster) != 0)
+		{
+			continue;
+		}
+		
+		fat_table_set(sdcard, cluster, nextcluster, &dirty);
+		fat_cluster_allocated(sdcard, cluster);
+		
+		nextcluster = cluster;
+		linked++;
+	}
+	
+	// Append to the existing chain
+	if(lastcluster != 0)
+	{
+		if(!fat_load_table_sector(sdcard, lastcluster, &dirty))
+		{
+			return 0;
+		}
+		
+		fat_table_set(sdcard, lastcluster, nextcluster, &dirty);
+	}
+	
+	return fat_flush_table_sector(sdcard, &dirty);
+}
+
+
+/*******************************************************************
+* Find and link a number of free clusters, see fat_allocate_clusters()
+* The clusters form one run when last - first + 1 == count. Aligned
+* and AU sized requests start in an empty AU, see
+* fat_get_allocation_start().
+*/
+static uint8_t fat_allocate_range(sdcard_t *sdcard, uint32_t lastcluster, uint32_t count, uint8_t contiguous, uint8_t aligned, uint32_t *first, uint32_t *last)
+{
+	if(count == 0)
+	{
+		return 0;
+	}
+	
+	// Not enough free space
+	if(sdcard->free_clusters != 0xFFFFFFFF && sdcard->free_clusters < count)
+	{
+		return 0;
+	}
+	
+	// Clusters set aside by fat_idle_work()
+	if(!contiguous && fat_ring_allocate(sdcard, lastcluster, count, first, last))
+	{
+		return 1;
+	}
+	
+	// AU sized requests start in an empty AU as well
+	if(sdcard->au_clusters != 0 && count >= sdcard->au_clusters)
+	{
+		aligned = 1;
+	}
+	
+	if(!fat_find_free_range(sdcard, fat_get_allocation_start(sdcard, lastcluster, count, aligned), count, contiguous, first, last))
+	{
+		printf("Unable to find %lu free clusters\n", (unsigned long)count);
+		return 0;
+	}
+	
+	return fat_link_free_range(sdcard, lastcluster, *first, *last, count);
+}
+
+
+/*******************************************************************
+* Allocate clusters for a file from its allocation window and append
+* them to the chain, see fat_allocate_clusters(). When the window can
+* not hold the request, a new window of at least FAT_ALLOC_WINDOW
+* clusters is reserved, starting in an empty allocation unit. Clusters
+* set aside by fat_idle_work() are only used when no free run is large
+* enough for a window. The allocation hint is moved past each new
+* window, so other files are allocated after it.
+*
+* @param sdcard		SD Card structure
+* @param window		Allocation window of the file, NULL for none
+* @param lastcluster	Last cluster of the chain to extend, 0 for a new chain
+* @param count			Number of clusters to allocate
+* @param first			First allocated cluster
+* @param last			Last allocated cluster
+*
+*/
+static uint8_t fat_allocate_window(sdcard_t *sdcard, fat_window *window, uint32_t lastcluster, uint32_t count, uint32_t *first, uint32_t *last)
+{
+	uint32_t size;
+	uint32_t windowfirst;
+	uint32_t windowlast;
+	
+	if(window == NULL || FAT_ALLOC_WINDOW == 0 || count == 0)
+	{
+		return fat_allocate_range(sdcard, lastcluster, count, 0, 0, first, last);
+	}
+	
+	// Not enough free space
+	if(sdcard->free_clusters != 0xFFFFFFFF && sdcard->free_clusters < count)
+	{
+		return 0;
+	}
+	
+	// The window is too small for this request
+	if(window->next >= window->end || (window->end - window->next) < count)
+	{
+		size = (count < FAT_ALLOC_WINDOW ? FAT_ALLOC_WINDOW : count);
+		
+		// Too little space left for a whole window
+		if(!fat_find_free_range(sdcard, fat_get_allocation_start(sdcard, lastcluster, size, 1), size, 0, &windowfirst, &windowlast))
+		{
+			window->next = 0;
+			window->end = 0;
+			
+			if(fat_ring_allocate(sdcard, lastcluster, count, first, last))
+			{
+				return 1;
+			}
+			
+			return fat_allocate_range(sdcard, lastcluster, count, 0, 0, first, last);
+		}
+		
+		window->next = windowfirst;
+		window->end = windowlast + 1;
+		
+		if(window->end > sdcard->next_free_cluster)
+		{
+			sdcard->next_free_cluster = (window->end > sdcard->data_clusters + 1 ? 2 : window->end);
+			sdcard->fsinfo_dirty = 1;
+		}
+	}
+	
+	if(!fat_find_free_range(sdcard, window->next, count, 0, first, last))
+	{
+		return 0;
+	}
+	
+	if(!fat_link_free_range(sdcard, lastcluster, *first, *last, count))
+	{
+		return 0;
+	}
+	
+	window->next = *last + 1;
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Give back the unused part of an allocation window. The allocation
+* hint is moved back to it if nothing was reserved after the window.
+*
+* @param sdcard		SD Card structure
+* @param window		Allocation window of the file
+*
+*/
+void fat_release_window(sdcard_t *sdcard, fat_window *window)
+{
+	if(window->next < window->end && window->end == sdcard->next_free_cluster)
+	{
+		sdcard->next_free_cluster = window->next;
+		sdcard->fsinfo_dirty = 1;
+	}
+	
+	window->next = 0;
+	window->end = 0;
+}
+
+
+/*******************************************************************
+* Allocate a number of clusters and append them to a chain
+* Contiguous clusters are preferred, and each FAT sector involved is
+* written only once.
+*
+* @param sdcard		SD Card structure
+* @param lastcluster	Last cluster of the chain to extend, 0 for a new chain
+* @param count			Number of clusters to allocate
+* @param first			Set to the first allocated cluster
+*
+*/
+uint8_t fat_allocate_clusters(sdcard_t *sdcard, uint32_t lastcluster, uint32_t count, uint32_t *first)
+{
+	uint32_t last;
+	
+	return fat_allocate_range(sdcard, lastcluster, count, 0, 0, first, &last);
+}
+
+
+/*******************************************************************
+* Allocate a contiguous run of clusters and append it to a chain
+* Meant for preallocation, a new run starts in an empty AU.
+* Fails if there is no free run long enough.
+*
+* @param sdcard		SD Card structure
+* @param lastcluster	Last cluster of the chain to extend, 0 for a new chain
+* @param count			Number of clusters to allocate
+* @param first			Set to the first allocated cluster
+*
+*/
+uint8_t fat_allocate_contiguous(sdcard_t *sdcard, uint32_t lastcluster, uint32_t count, uint32_t *first)
+{
+	uint32_t last;
+	
+	return fat_allocate_range(sdcard, lastcluster, count, 1, 1, first, &last);
+}
+
+
+/*******************************************************************
+* Allocate a new cluster for a chain
+* The search for a free cluster starts from the allocation hint
+*
+* @param sdcard		SD Card structure
+* @param cluster		Cluster to allocate for
+*
+*/
+uint32_t fat_allocate_cluster(sdcard_t *sdcard, uint32_t cluster)
+{
+	uint32_t nextcluster;
+	
+	if(!fat_allocate_clusters(sdcard, cluster, 1, &nextcluster))
+	{
+		return 0;
+	}
+	
+	return nextcluster;
+}
+
+
+
+/*******************************************************************
+* Hash of a long name, at most "length" characters up to the first 0x00
+*/
+static uint32_t fat_name_hash32(const char *name, uint16_t length)
+{
+	uint32_t hash = 2166136261UL;
+	uint16_t i;
+	
+	for(i = 0; i < length && name[i] != 0x00; i++)
+	{
+		hash = (hash ^ (uint8_t)name[i]) * 16777619UL;
+	}
+	
+	return hash;
+}
+
+
+/*******************************************************************
+* Check the long name stored at a position of a directory
+* The entries are read from the first long name entry up to the
+* short name entry. Returns the short name entry in the sector
+* buffer, or NULL if another name is stored there.
+*
+* @param sdcard			SD Card structure
+* @param cluster			First cluster of the directory
+* @param position		Position of the first entry (sector * 16 + entry)
+* @param match			Matcher started with the long name
+* @param found			Set to the location of the short name entry
+*
+*/
+static dir_short_t * fat_match_at(sdcard_t *sdcard, uint32_t cluster, uint32_t position, lfn_match *match, fat_entry *found)
+{
+	uint32_t sector;
+	uint8_t entry;
+	dir_short_t *dir;
+	
+	sector = (position >> 4);
+	entry = (position & 0x0F);
+	lfn_match_reset(match);
+	
+	while(1)
+	{
+		if(entry == 16)
+		{
+			entry = 0;
+			sector++;
+		}
+		
+		if(!fat_read_sector(sdcard, cluster, sector))
+		{
+			return NULL;
+		}
+		
+		dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
+		
+		if(fat_is_lfn_entry(dir) && lfn_match_add(match, dir))
+		{
+			entry++;
+			continue;
+		}
+		
+		if(fat_is_sfn_entry(dir) && lfn_match_sfn(match, dir))
+		{
+			found->cluster = cluster;
+			found->sector = sector;
+			found->entry = entry;
+			
+			return dir;
+		}
+		
+		return NULL;
+	}
+}
+
+
+#if FAT_DIR_INDEX
+/*******************************************************************
+* Hash of a long name folded to 16 bits for the directory indexes
+*/
+static uint16_t fat_name_hash(const char *name, uint16_t length)
+{
+	uint32_t hash;
+	
+	hash = fat_name_hash32(name, length);
+	
+	return (uint16_t)(hash ^ (hash >> 16));
+}
+
+
+/*******************************************************************
+* Add a name to a directory index
+* Returns 0 when the index is too full to stay fast
+*
+* @param index			Directory index
+* @param hash				Hash of the long name
+* @param position		Position of the first entry of the name
+*
+*/
+static uint8_t fat_index_insert(fat_dir_index *index, uint16_t hash, uint16_t position)
+{
+	uint16_t slot;
+	
+	// Positions that collide with the markers can not be stored
+	if(position >= FAT_INDEX_DELETED || index->filled >= (index->size - (index->size / 4)))
+	{
+		return 0;
+	}
+	
+	slot = hash & (index->size - 1);
+	
+	while(index->slots[slot].position != FAT_INDEX_EMPTY && index->slots[slot].position != FAT_INDEX_DELETED)
+	{
+		slot = (slot + 1) & (index->size - 1);
+	}
+	
+	if(index->slots[slot].position == FAT_INDEX_EMPTY)
+	{
+		index->filled++;
+	}
+	
+	index->slots[slot].hash = hash;
+	index->slots[slot].position = position;
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Allocate an empty directory index
+* Returns NULL if there is not enough memory
+*
+* @param cluster			First cluster of the directory
+* @param size				Number of slots, a power of two
+*
+*/
+static fat_dir_index * fat_index_alloc(uint32_t cluster, uint16_t size)
+{
+	fat_dir_index *index;
+	
+	index = malloc(sizeof(fat_dir_index) + (size * sizeof(fat_index_slot)));
+	if(index == NULL)
+	{
+		return NULL;
+	}
+	
+	index->next = NULL;
+	index->cluster = cluster;
+	index->size = size;
+	index->filled = 0;
+	memset(index->slots, 0xFF, size * sizeof(fat_index_slot));
+	
+	return index;
+}
+
+
+/*******************************************************************
+* Double the slots of an index that is not in the index list
+* The names are hashed into a new table and the old one is freed.
+* Returns 0 and keeps the old table if it can not grow.
+*
+* @param index			Pointer to the directory index
+*
+*/
+static uint8_t fat_index_grow(fat_dir_index **index)
+{
+	fat_dir_index *grown;
+	uint16_t slot;
+	
+	if((*index)->size >= FAT_DIR_INDEX_MAX_SLOTS)
+	{
+		return 0;
+	}
+	
+	grown = fat_index_alloc((*index)->cluster, (*index)->size * 2);
+	if(grown == NULL)
+	{
+		return 0;
+	}
+	
+	for(slot = 0; slot < (*index)->size; slot++)
+	{
+		if((*index)->slots[slot].position < FAT_INDEX_DELETED)
+		{
+			fat_index_insert(grown, (*index)->slots[slot].hash, (*index)->slots[slot].position);
+		}
+	}
+	
+	free(*index);
+	*index = grown;
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Index every long name in a directory with one scan
+* The cluster chain is followed once, its end is the end of the
+* directory when there is no end marker. The index grows when the
+* directory has more names than it can hold.
+* Returns 0 if the directory could not be read or has too many names,
+* the index can not be used then.
+*
+* @param sdcard			SD Card structure
+* @param index			Pointer to the directory index to fill
+*
+*/
+static uint8_t fat_index_build(sdcard_t *sdcard, fat_dir_index **index)
+{
+	uint32_t cluster;
+	uint32_t sector;
+	uint32_t block;
+	uint8_t entry;
+	uint16_t first = 0;
+	uint16_t hash;
+	dir_short_t *dir;
+	lfn_cache lfn;
+	
+	lfn_cache_reset(&lfn);
+	cluster = fat_entry_cluster(sdcard, (*index)->cluster);
+	
+	for(sector = 0; ; sector++)
+	{
+		// Special case, FAT16 root directory
+		if(FAT_IS_FAT16(sdcard) && cluster == 0)
+		{
+			if(sector >= sdcard->rootdir_sectors) { return 1; }
+			block = sdcard->rootdir_begin_sector + sector;
+		}
+		else
+		{
+			// Next cluster of the directory
+			if(sector > 0 && (sector & sdcard->cluster_mask) == 0)
+			{
+				cluster = fat_get_next_cluster(sdcard, cluster);
+				
+				if(cluster == 0) { return 0; }
+				if(fat_entry_is_end(sdcard, fat_entry_cluster(sdcard, cluster))) { return 1; }
+			}
+			
+			block = fat_get_cluster_sector(sdcard, cluster) + (sector & sdcard->cluster_mask);
+		}
+		
+		if(!sd_read_block(sdcard, block, 0))
+		{
+			return 0;
+		}
+		
+		for(entry = 0; entry < 16; entry++)
+		{
+			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
+			
+			if(fat_is_last_entry(dir)) { return 1; }
+			if(fat_is_free_entry(dir)) { lfn_cache_reset(&lfn); continue; }
+			
+			if(fat_is_lfn_entry(dir))
+			{
+				// First entry of a name
+				if(lfn.strings == 0)
+				{
+					first = (sector << 4) | entry;
+				}
+				
+				lfn_cache_add(&lfn, dir);
+				continue;
+			}
+			
+			if(fat_is_sfn_entry(dir) && lfn.strings > 0)
+			{
+				hash = fat_name_hash(lfn.filename[0], lfn.strings * 13);
+				
+				if(!fat_index_insert(*index, hash, first) && (!fat_index_grow(index) || !fat_index_insert(*index, hash, first)))
+				{
+					return 0;
+				}
+			}
+			
+			lfn_cache_reset(&lfn);
+		}
+	}
+}
+
+
+/*******************************************************************
+* Take the index or marker of a directory out of the index list
+* Returns NULL if the directory is not in the list.
+*
+* @param sdcard			SD Card structure
+* @param cluster			First cluster of the directory
+*
+*/
+static fat_dir_index * fat_index_unlink(sdcard_t *sdcard, uint32_t cluster)
+{
+	fat_dir_index *index;
+	fat_dir_index *prev = NULL;
+	
+	for(index = sdcard->dir_index; index != NULL; prev = index, index = index->next)
+	{
+		if(index->cluster == cluster)
+		{
+			if(prev == NULL)
+			{
+				sdcard->dir_index = index->next;
+			}
+			else
+			{
+				prev->next = index->next;
+			}
+			
+			index->next = NULL;
+			return index;
+		}
+	}
+	
+	return NULL;
+}
+
+
+/*******************************************************************
+* Put an index or marker at the front of the index list
+* The least recently used indexes and markers beyond
+* FAT_DIR_INDEX_DIRS and FAT_DIR_NOINDEX_DIRS are freed.
+*
+* @param sdcard			SD Card structure
+* @param index			Index or marker that is not in the list
+*
+*/
+static void fat_index_push(sdcard_t *sdcard, fat_dir_index *index)
+{
+	fat_dir_index *prev;
+	uint8_t indexes = 0;
+	uint8_t markers = 0;
+	
+	index->next = sdcard->dir_index;
+	sdcard->dir_index = index;
+	
+	for(prev = NULL; index != NULL; index = (prev == NULL ? sdcard->dir_index : prev->next))
+	{
+		if(index->size == 0 ? (++markers > FAT_DIR_NOINDEX_DIRS) : (++indexes > FAT_DIR_INDEX_DIRS))
+		{
+			// Never the first one, both limits are at least 1
+			prev->next = index->next;
+			free(index);
+		}
+		else
+		{
+			prev = index;
+		}
+	}
+}
+
+
+/*******************************************************************
+* Get the index of a directory, most recently used first
+* The index is built if the directory has none and "build" is set.
+* A directory that can not be indexed keeps a marker without slots
+* in the list, so it is not scanned for an index again.
+* Returns NULL if the directory has no usable index.
+*
+* @param sdcard			SD Card structure
+* @param cluster			First cluster of the directory
+* @param build			Build a missing index
+*
+*/
+static fat_dir_index * fat_index_get(sdcard_t *sdcard, uint32_t cluster, uint8_t build)
+{
+	fat_dir_index *index;
+	
+	index = fat_index_unlink(sdcard, cluster);
+	if(index != NULL)
+	{
+		fat_index_push(sdcard, index);
+		
+		return (index->size == 0 ? NULL : index);
+	}
+	
+	if(!build)
+	{
+		return NULL;
+	}
+	
+	index = fat_index_alloc(cluster, FAT_DIR_INDEX_SLOTS);
+	if(index == NULL)
+	{
+		return NULL;
+	}
+	
+	if(!fat_index_build(sdcard, &index))
+	{
+		free(index);
+		
+		// Remember the directory with a marker
+		index = fat_index_alloc(cluster, 0);
+		if(index != NULL)
+		{
+			fat_index_push(sdcard, index);
+		}
+		
+		return NULL;
+	}
+	
+	fat_index_push(sdcard, index);
+	
+	return index;
+}
+
+
+/*******************************************************************
+* Find a long name using the index of its directory
+* Every entry with a matching hash is checked on the card, the
+* returned entry is in the sector buffer.
+*
+* @param sdcard			SD Card structure
+* @param index			Directory index
+* @param filename			Longname of the file/dir to find
+*
+*/
+static dir_short_t * fat_index_find(sdcard_t *sdcard, fat_dir_index *index, const char *filename, fat_entry *found)
+{
+	uint16_t hash;
+	uint16_t slot;
+	dir_short_t *dir;
+	lfn_match match;
+	
+	hash = fat_name_hash(filename, 255);
+	lfn_match_start(&match, filename);
+	
+	for(slot = hash & (index->size - 1); index->slots[slot].position != FAT_INDEX_EMPTY; slot = (slot + 1) & (index->size - 1))
+	{
+		if(index->slots[slot].hash != hash || index->slots[slot].position == FAT_INDEX_DELETED)
+		{
+			continue;
+		}
+		
+		dir = fat_match_at(sdcard, index->cluster, index->slots[slot].position, &match, found);
+		if(dir != NULL)
+		{
+			return dir;
+		}
+	}
+	
+	return NULL;
+}
+
+
+#endif
+
+
+/*******************************************************************
+* Free every directory index, used when the card changes
+*
+* @param sdcard			SD Card structure
+*
+*/
+void fat_dir_index_clear(sdcard_t *sdcard)
+{
+#if FAT_DIR_INDEX
+	fat_dir_index *index;
+	
+	while(sdcard->dir_index != NULL)
+	{
+		index = sdcard->dir_index;
+		sdcard->dir_index = index->next;
+		free(index);
+	}
+#endif
+}
+
+
+/*******************************************************************
+* Drop the index of one directory, it is rebuilt on the next lookup
+* Call this after changing the names of a directory without
+* fat_create_file(). A directory that could not be indexed is tried
+* again as well.
+*
+* @param sdcard			SD Card structure
+* @param cluster			First cluster of the directory
+*
+*/
+void fat_dir_index_forget(sdcard_t *sdcard, uint32_t cluster)
+{
+#if FAT_DIR_INDEX
+	free(fat_index_unlink(sdcard, cluster));
+#endif
+}
+
+
+#if FAT_DIR_INDEX
+/*******************************************************************
+* Remove a name from the index of its directory, if there is one
+* The index is dropped when the name is not in it.
+*
+* @param sdcard			SD Card structure
+* @param cluster			First cluster of the directory
+* @param filename			Longname of the removed file/dir
+* @param position		Position of the first entry of the name
+*
+*/
+static void fat_index_remove(sdcard_t *sdcard, uint32_t cluster, const char *filename, uint32_t position)
+{
+	fat_dir_index *index;
+	uint16_t hash;
+	uint16_t slot;
+	
+	index = fat_index_get(sdcard, cluster, 0);
+	if(index == NULL)
+	{
+		return;
+	}
+	
+	hash = fat_name_hash(filename, 255);
+	
+	for(slot = hash & (index->size - 1); index->slots[slot].position != FAT_INDEX_EMPTY; slot = (slot + 1) & (index->size - 1))
+	{
+		if(index->slots[slot].hash == hash && index->slots[slot].position == position)
+		{
+			index->slots[slot].position = FAT_INDEX_DELETED;
+			return;
+		}
+	}
+	
+	fat_dir_index_forget(sdcard, cluster);
+}
+#endif
+
+
+/*******************************************************************
+* Find a specific file or directory by longname
+* Directories are looked up through their name index when
+* FAT_DIR_INDEX is set, otherwise every entry is compared.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster to start searching from
+* @param filename			Longname of the file/dir to find
+* @param found			Set to the location of the short name entry
+*
+*/
+static dir_short_t * fat_find_entry(sdcard_t *sdcard, uint32_t startcluster, const char * filename, fat_entry *found)
+{
+	uint32_t cluster;
+	uint32_t sector;
+	uint32_t entry;
+	dir_short_t *dir;
+	lfn_match match;
+#if FAT_DIR_INDEX
+	fat_dir_index *index;
+	
+	index = fat_index_get(sdcard, startcluster, 1);
+	if(index != NULL)
+	{
+		return fat_index_find(sdcard, index, filename, found);
+	}
+#endif
+
+	lfn_match_start(&match, filename);
+	
+	// Start cluster
+	cluster = startcluster;
+	sector = 0;
+	
+	while(1)
+	{
+		printf("Reading cluster: %lu -> %lu\n", (unsigned long)cluster, (unsigned long)sector);
+		if(!fat_read_sector(sdcard, cluster, sector))
+		{
+			return 0;
+		}
+				
+		//
+		// Loop directory entries in this sector
+		//
+		for(entry = 0; entry < 16; entry++)
+		{
+			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
+			
+			// Last entry
+			if(fat_is_last_entry(dir)) { return 0; }			
+			// Free entry
+			if(fat_is_free_entry(dir)) { lfn_match_reset(&match); continue; }
+			
+			// Long name entry, compared as it is read
+			if(fat_is_lfn_entry(dir))
+			{
+				lfn_match_add(&match, dir);
+				continue;
+			}
+			
+			// Directory or file entry
+			if(fat_is_sfn_entry(dir))
+			{
+				if(lfn_match_sfn(&match, dir))
+				{
+					found->cluster = startcluster;
+					found->sector = sector;
+					found->entry = entry;
+					
+					return dir;
+				}
+				
+				continue;
+			}
+		}
+
+		// Increment sector
+		sector++;
+	}
+	
+	//printf("End of function\n");
+	return 0;
+}
+
+
+/*******************************************************************
+* Find a specific file or directory by longname
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster to start searching from
+* @param filename			Longname of the file/dir to find
+*
+*/
+dir_short_t * fat_find_lfn(sdcard_t *sdcard, uint32_t startcluster, const char * filename)
+{
+	fat_entry found;
+	
+	return fat_find_entry(sdcard, startcluster, filename, &found);
+}
+
+
+/*******************************************************************
+* Find a subdirectory by longname, for walking paths
+* Directories found are kept in the dentry cache of the card, so the
+* directories above a file are only scanned the first time a path
+* through them is used. A cached directory is matched by the hash and
+* length of its name and then checked against the entries at its
+* cached location, the directory is scanned again if they changed.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	First cluster of the parent directory
+* @param dirname			Longname of the directory to find
+* @param cluster			Set to the first cluster of the directory
+*
+*/
+uint8_t fat_find_dir(sdcard_t *sdcard, uint32_t startcluster, const char * dirname, uint32_t *cluster)
+{
+	dir_short_t *dir;
+	fat_dentry dentry;
+	fat_entry found;
+	lfn_match match;
+	uint8_t i;
+	
+	dentry.parent = startcluster;
+	dentry.length = strlen(dirname);
+	dentry.hash = fat_name_hash32(dirname, dentry.length);
+	
+	for(i = 0; i < FAT_DENTRY_CACHE_SIZE && sdcard->dentry[i].length != 0; i++)
+	{
+		if(sdcard->dentry[i].parent == startcluster &&
+			sdcard->dentry[i].hash == dentry.hash &&
+			sdcard->dentry[i].length == dentry.length)
+		{
+			// Move to the front, the last entry is the least recently used
+			dentry = sdcard->dentry[i];
+			memmove(&sdcard->dentry[1], &sdcard->dentry[0], i * sizeof(fat_dentry));
+			sdcard->dentry[0] = dentry;
+			
+			// Check the name is still this directory
+			lfn_match_start(&match, dirname);
+			dir = fat_match_at(sdcard, startcluster, dentry.position, &match, &found);
+			
+			if(dir != NULL && (dir->DIR_Attr & ATTR_DIRECTORY) &&
+				(((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO) == (dentry.cluster == sdcard->rootdir_begin_cluster ? 0 : dentry.cluster))
+			{
+				*cluster = dentry.cluster;
+				return 1;
+			}
+			
+			// Scan the directory again
+			memmove(&sdcard->dentry[0], &sdcard->dentry[1], (FAT_DENTRY_CACHE_SIZE - 1) * sizeof(fat_dentry));
+			sdcard->dentry[FAT_DENTRY_CACHE_SIZE - 1].length = 0;
+			dentry.length = strlen(dirname);
+			break;
+		}
+	}
+	
+	dir = fat_find_entry(sdcard, startcluster, dirname, &found);
+	if(dir == NULL || !(dir->DIR_Attr & ATTR_DIRECTORY))
+	{
+		return 0;
+	}
+	
+	dentry.attr = dir->DIR_Attr;
+	dentry.cluster = (((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO);
+	
+	// First entry of the name, the long name entries come before the short one
+	dentry.position = ((found.sector << 4) | found.entry) - ((dentry.length + 12) / 13);
+	
+	// ".." of a directory in the root holds 0
+	if(dentry.cluster == 0)
+	{
+		dentry.cluster = sdcard->rootdir_begin_cluster;
+	}
+	
+	// Names that do not fit in the length field are not cached
+	if(dentry.length != 0)
+	{
+		memmove(&sdcard->dentry[1], &sdcard->dentry[0], (FAT_DENTRY_CACHE_SIZE - 1) * sizeof(fat_dentry));
+		sdcard->dentry[0] = dentry;
+	}
+	
+	*cluster = dentry.cluster;
+	return 1;
+}
+
+
+/*******************************************************************
+* Forget the cached directories, after the card has been changed
+*
+* @param sdcard			SD Card structure
+*
+*/
+void fat_dentry_clear(sdcard_t *sdcard)
+{
+	uint8_t i;
+	
+	for(i = 0; i < FAT_DENTRY_CACHE_SIZE; i++)
+	{
+		sdcard->dentry[i].length = 0;
+	}
+}
+
+/*******************************************************************
+* Forget a directory and the directories found in it, after it has
+* been removed or renamed
+*
+* @param sdcard			SD Card structure
+* @param cluster			First cluster of the directory
+*
+*/
+void fat_dentry_forget(sdcard_t *sdcard, uint32_t cluster)
+{
+	uint8_t i;
+	uint8_t kept = 0;
+	
+	for(i = 0; i < FAT_DENTRY_CACHE_SIZE; i++)
+	{
+		if(sdcard->dentry[i].length != 0 && sdcard->dentry[i].cluster != cluster && sdcard->dentry[i].parent != cluster)
+		{
+			sdcard->dentry[kept] = sdcard->dentry[i];
+			kept++;
+		}
+	}
+	
+	for(; kept < FAT_DENTRY_CACHE_SIZE; kept++)
+	{
+		sdcard->dentry[kept].length = 0;
+	}
+}
+
+
+/*******************************************************************
+* Find a specific file or directory by shortname
+* Used to know what the next free tail number is when creating files
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster to start searching from
+* @param filename			Shortname of the file/dir to find
+*
+*/
+dir_short_t * fat_find_sfn(sdcard_t *sdcard, uint32_t startcluster, const char * filename)
+{
+	uint32_t cluster;
+	uint32_t sector;
+	uint32_t entry;
+	dir_short_t *dir;
+	
+	// Start cluster
+	cluster = startcluster;
+	sector = 0;
+	
+	while(1)
+	{
+		printf("Reading cluster: %lu -> %lu\n", (unsigned long)cluster, (unsigned long)sector);
+		if(!fat_read_sector(sdcard, cluster, sector))
+		{
+			return 0;
+		}
+				
+		//
+		// Loop directory entries in this sector
+		//
+		for(entry = 0; entry < 16; entry++)
+		{
+			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
+			
+			// Last entry
+			if(fat_is_last_entry(dir)) { return 0; }			
+			// Free entry
+			if(fat_is_free_entry(dir)) { continue; }
+			// Long name entry
+			if(fat_is_lfn_entry(dir)) { continue; }
+			
+			// Directory or file entry
+			if(fat_is_sfn_entry(dir))
+			{
+				if(sfn_compare((char*)dir->DIR_Name, filename))
+				{
+					return dir;
+				}
+		
+				continue;
+			}
+		}
+
+		// Increment sector
+		sector++;
+	}
+	
+	return 0;
+}
+
+
+/*******************************************************************
+* Find the first free entry that can contain "entries" number
+* of consecutive free entries
+*
+* @param sdcard			SD Card structure
+* @param startcluster	Cluster to start looking from
+* @param entries			Number of entries needed
+*
+* @return dir_short_t * or 0 if none found
+*/
+fat_entry * fat_find_free_entry(sdcard_t *sdcard, uint32_t startcluster, uint8_t entries)
+{
+	uint32_t sector;
+	uint8_t entry;
+	uint8_t count;
+	fat_entry * firstentry;
+	dir_short_t *dir;
+	
+	if(entries < 1)
+	{
+		return NULL;
+	}
+	
+	firstentry = malloc(sizeof(fat_entry));
+	if(firstentry == NULL)
+	{
+		return NULL;
+	}
+	
+	count = 0;
+	firstentry->cluster = startcluster;
+	firstentry->sector = 0;
+	firstentry->entry = 0;
+	
+	// Start cluster
+	sector = 0;
+	
+	while(1)
+	{
+		if(!fat_read_sector(sdcard, startcluster, sector))
+		{
+			free(firstentry);
+			return 0;
+		}
+		
+		printf("Reading cluster: %lu -> %lu\n", (unsigned long)startcluster, (unsigned long)sector);
+		
+		//
+		// Loop directory entries in this sector
+		//
+		for(entry = 0; entry < 16; entry++)
+		{
+			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
+			
+			// Free entry
+			if(fat_is_last_entry(dir) || fat_is_free_entry(dir))
+			{
+				// First valid
+				if(count == 0)
+				{
+					firstentry->sector = sector;
+					firstentry->entry = entry;
+				}
+				
+				count++;
+				
+				// We have found the needed number of free entries
+				if(count == entries)
+				{
+					return firstentry;
+				}
+			}
+			// Entry is not free, invalidate
+			else
+			{
+				count = 0;
+			}
+		}
+		
+		// Increment sector
+		sector++;
+	}
+	
+	printf("End of function\n");
+	free(firstentry);
+	return NULL;
+}
+
+
+
+/*******************************************************************
+* Load the directory sector holding the entry at handle->ptr
+* The handle keeps the cluster it is in and where that cluster starts,
+* so going through a directory follows its chain once instead of from
+* the first cluster for every sector. Moving ptr back before the
+* cluster restarts the chain from the first cluster.
+*
+* @param sdcard			SD Card structure
+* @param handle			FAT handle of the directory
+*
+*/
+static uint8_t fat_load_cursor_sector(sdcard_t *sdcard, fat_handle *handle)
+{
+	uint32_t sector;
+	uint32_t nextcluster;
+	
+	sector = (handle->ptr >> sdcard->sector_shift);
+	
+	// Special case, FAT16 root directory
+	if(FAT_IS_FAT16(sdcard) && handle->datacluster == 0)
+	{
+		if(sector >= sdcard->rootdir_sectors) return 0;
+		return sd_read_block(sdcard, sdcard->rootdir_begin_sector + sector, 0);
+	}
+	
+	// Rewound
+	if(handle->ptr < handle->dirstart)
+	{
+		handle->dircluster = handle->datacluster;
+		handle->dirstart = 0;
+	}
+	
+	// Follow the chain to the cluster holding ptr
+	while(((handle->ptr - handle->dirstart) >> (sdcard->sector_shift + sdcard->cluster_shift)) != 0)
+	{
+		nextcluster = fat_get_next_cluster(sdcard, handle->dircluster);
+		
+		if(nextcluster < 2 || fat_entry_is_end(sdcard, nextcluster))
+		{
+			return 0;
+		}
+		
+		handle->dircluster = nextcluster;
+		handle->dirstart += ((uint32_t)sdcard->blocksize << sdcard->cluster_shift);
+	}
+	
+	if(handle->dircluster < 2)
+	{
+		return 0;
+	}
+	
+	return sd_read_block(sdcard, fat_get_cluster_sector(sdcard, handle->dircluster) + (sector & sdcard->cluster_mask), 0);
+}
+
+
+/*******************************************************************
+* Find the next file or directory based on a byte offset from the
+* directory start
+* Used by readdir
+*
+* @param sdcard			SD Card structure
+* @param handle			FAT handle
+* @param lfn				Long file name decoder (optional)
+*
+*/
+dir_short_t * fat_find_next_file(sdcard_t *sdcard, fat_handle *handle, lfn_decode *lfn)
+{
+	uint32_t offset;
+	dir_short_t *dir;
+	
+	if(lfn != NULL)
+	{
+		lfn_decode_reset(lfn);
+	}
+	
+	offset = (handle->ptr & sdcard->sector_mask);
+	
+	while(1)
+	{
+		if(!fat_load_cursor_sector(sdcard, handle))
+		{
+			return 0;
+		}
+				
+		//
+		// Loop directory entries in this sector
+		//
+		for(; offset < sdcard->blocksize; offset += 32)
+		{
+			dir = (dir_short_t *)(sdcard->buffer + offset);
+			
+			// Last entry
+			if(fat_is_last_entry(dir))
+			{
+				if(lfn != NULL)
+				{
+					lfn_decode_reset(lfn);
+				}
+				
+				return 0;
+			}
+			
+			// Increment offset
+			handle->ptr += 32;
+			
+			// Free entry
+			if(fat_is_free_entry(dir))
+			{
+				if(lfn != NULL)
+				{
+					lfn_decode_reset(lfn);
+				}
+				
+				continue;
+			}
+			
+			//
+			// Long name entry
+			//
+			if(fat_is_lfn_entry(dir))
+			{
+				if(lfn != NULL)
+				{
+					lfn_decode_add(lfn, dir);
+				}
+				
+				continue;
+			}
+			
+			//
+			// Directory or file entry
+			//
+			if(fat_is_sfn_entry(dir))
+			{
+				return dir;
+			}
+		}
+		
+		// Next sector
+		offset = 0;
+	}
+}
+
+
+
+/*******************************************************************
+* Fill a directory entry from the short name entry and the long name
+* decoded into entry->name before it
+*
+* @param entry			Directory entry to fill
+* @param dir				Short name entry
+* @param lfn				Long file name decoder writing to entry->name
+*
+*/
+void fat_fill_dirent(fat_dirent *entry, dir_short_t *dir, lfn_decode *lfn)
+{
+	if(!lfn_decode_sfn(lfn, dir))
+	{
+		sfn_to_string(dir, entry->name);
+	}
+	
+	entry->attr = dir->DIR_Attr;
+	entry->size = dir->DIR_FileSize;
+	entry->cluster = (((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO);
+	entry->crttime = dir->DIR_CrtTime;
+	entry->crtdate = dir->DIR_CrtDate;
+	entry->wrttime = dir->DIR_WrtTime;
+	entry->wrtdate = dir->DIR_WrtDate;
+	entry->accdate = dir->DIR_LstAccDate;
+}
+
+
+/*******************************************************************
+* Fill up to "max" directory entries from handle->ptr on
+* Every entry of a directory sector is decoded while it is loaded,
+* long names go straight into the name of the entry being filled.
+* Returns the number of entries filled.
+*
+* @param sdcard			SD Card structure
+* @param handle			FAT handle of the directory
+* @param entries			Entries to fill
+* @param max				Number of entries
+*
+*/
+uint16_t fat_find_next_files(sdcard_t *sdcard, fat_handle *handle, fat_dirent *entries, uint16_t max)
+{
+	uint32_t offset;
+	uint16_t count = 0;
+	dir_short_t *dir;
+	lfn_decode lfn;
+	
+	if(max == 0)
+	{
+		return 0;
+	}
+	
+	lfn_decode_start(&lfn, entries[0].name);
+	
+	offset = (handle->ptr & sdcard->sector_mask);
+	
+	while(count < max)
+	{
+		if(!fat_load_cursor_sector(sdcard, handle))
+		{
+			break;
+		}
+		
+		for(; offset < sdcard->blocksize && count < max; offset += 32)
+		{
+			dir = (dir_short_t *)(sdcard->buffer + offset);
+			
+			// Last entry
+			if(fat_is_last_entry(dir))
+			{
+				return count;
+			}
+			
+			handle->ptr += 32;
+			
+			// Free entry
+			if(fat_is_free_entry(dir))
+			{
+				lfn_decode_reset(&lfn);
+				continue;
+			}
+			
+			// Long name entry
+			if(fat_is_lfn_entry(dir))
+			{
+				lfn_decode_add(&lfn, dir);
+				continue;
+			}
+			
+			// Directory or file entry, the next name goes to the next entry
+			if(fat_is_sfn_entry(dir))
+			{
+				fat_fill_dirent(&entries[count], dir, &lfn);
+				count++;
+				
+				if(count < max)
+				{
+					lfn_decode_start(&lfn, entries[count].name);
+				}
+			}
+		}
+		
+		// Next sector
+		offset = 0;
+	}
+	
+	return count;
+}
+
+
+
+/*******************************************************************
+* Get the tail number of a short name, 0 if it has none
+* The tail is a '~' followed by digits up to the end of the name part.
+*/
+static uint16_t fat_sfn_tail(const uint8_t *name)
+{
+	uint16_t tail = 0;
+	int8_t i;
+	
+	// Last '~' in the name part
+	for(i = 7; i > 0 && name[i] != '~'; i--);
+	
+	// No tail, or a tail without digits or with a leading zero
+	if(i == 0 || i == 7 || name[i+1] == '0')
+	{
+		return 0;
+	}
+	
+	for(i++; i < 8; i++)
+	{
+		if(name[i] < '0' || name[i] > '9')
+		{
+			return 0;
+		}
+		
+		tail = (tail * 10) + (name[i] - '0');
+	}
+	
+	return tail;
+}
+
+
+/*******************************************************************
+* Mark the tail of a short name as used, if the short name belongs
+* to the long name and the tail is within the window
+*
+* @param dir				Short name entry
+* @param filename			Longname of the file to create
+* @param low				First tail number of the window
+* @param used				Bitmap of FAT_SFN_TAIL_WINDOW tails
+*
+*/
+static void fat_mark_tail(dir_short_t *dir, const char *filename, uint16_t low, uint8_t *used)
+{
+	uint16_t tail;
+	char candidate[13];
+	
+	tail = fat_sfn_tail(dir->DIR_Name);
+	
+	if(tail < low || tail >= (low + FAT_SFN_TAIL_WINDOW))
+	{
+		return;
+	}
+	
+	// Same base name with this tail
+	lfn_to_sfn(filename, candidate, tail);
+	
+	if(sfn_compare((char *)dir->DIR_Name, candidate))
+	{
+		used[(tail - low) >> 3] |= (1 << ((tail - low) & 7));
+	}
+}
+
+
+/*******************************************************************
+* Take the lowest tail number not marked in a window
+* Returns the tail number, 0 if all of them are used.
+*
+* @param filename			Longname of the file to create
+* @param low				First tail number of the window
+* @param used				Bitmap of FAT_SFN_TAIL_WINDOW tails
+* @param sfn				Set to the short name with the tail
+*
+*/
+static uint16_t fat_pick_tail(const char *filename, uint16_t low, uint8_t *used, char *sfn)
+{
+	uint16_t tail;
+	
+	// Tails 1 to 9998 are used by lfn_to_sfn()
+	for(tail = low; tail < (low + FAT_SFN_TAIL_WINDOW) && tail < 9999; tail++)
+	{
+		if(!(used[(tail - low) >> 3] & (1 << ((tail - low) & 7))))
+		{
+			lfn_to_sfn(filename, sfn, tail);
+			return tail;
+		}
+	}
+	
+	return 0;
+}
+
+
+/*******************************************************************
+* Find the lowest free short name tail number for a long name
+* Each directory scan marks the tails in use within a window of
+* FAT_SFN_TAIL_WINDOW numbers, a new scan is only needed when every
+* tail in the window is taken.
+* Returns the tail number, 0 if none is free.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster of the directory
+* @param filename			Longname of the file to create
+* @param low				First tail number to consider
+* @param sfn				Set to the short name with the tail
+*
+*/
+static uint16_t fat_find_free_tail(sdcard_t *sdcard, uint32_t startcluster, const char *filename, uint16_t low, char *sfn)
+{
+	uint8_t used[FAT_SFN_TAIL_WINDOW / 8];
+	uint16_t tail;
+	uint32_t sector;
+	uint8_t entry;
+	uint8_t done;
+	dir_short_t *dir;
+	
+	for(; low < 9999; low += FAT_SFN_TAIL_WINDOW)
+	{
+		memset(used, 0x00, sizeof(used));
+		done = 0;
+		
+		for(sector = 0; !done; sector++)
+		{
+			// End of the directory
+			if(!fat_read_sector(sdcard, startcluster, sector))
+			{
+				break;
+			}
+			
+			for(entry = 0; entry < 16; entry++)
+			{
+				dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
+				
+				if(fat_is_last_entry(dir)) { done = 1; break; }
+				if(fat_is_free_entry(dir) || fat_is_lfn_entry(dir)) { continue; }
+				
+				fat_mark_tail(dir, filename, low, used);
+			}
+		}
+		
+		tail = fat_pick_tail(filename, low, used, sfn);
+		
+		if(tail != 0)
+		{
+			return tail;
+		}
+	}
+	
+	return 0;
+}
+
+
+/*******************************************************************
+* Scan a directory once for everything fat_create_file() needs:
+* whether the long name exists, the first run of "entries" free
+* entries and the short name tails in use in the first tail window.
+* A free run at the end may continue past the last sector, the
+* directory is then extended when the entries are written.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster of the directory
+* @param filename			Longname to look for
+* @param entries			Number of consecutive free entries needed
+* @param scan				Scan results
+*
+*/
+static uint8_t fat_scan_directory(sdcard_t *sdcard, uint32_t startcluster, const char *filename, uint8_t entries, fat_dir_scan *scan)
+{
+	uint32_t sector;
+	uint8_t entry;
+	uint8_t count = 0;
+	dir_short_t *dir;
+	lfn_match match;
+	
+	scan->exists = 0;
+	scan->space = 0;
+	scan->found.cluster = startcluster;
+	scan->free.cluster = startcluster;
+	memset(scan->tails, 0x00, sizeof(scan->tails));
+	lfn_match_start(&match, filename);
+	
+	for(sector = 0; ; sector++)
+	{
+		// Past the end of the directory
+		if(!fat_read_sector(sdcard, startcluster, sector))
+		{
+			if(sector == 0)
+			{
+				return 0;
+			}
+			
+			break;
+		}
+		
+		for(entry = 0; entry < 16; entry++)
+		{
+			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
+			
+			// Last entry, every entry after it is free
+			if(fat_is_last_entry(dir))
+			{
+				if(!scan->space && count == 0)
+				{
+					scan->free.sector = sector;
+					scan->free.entry = entry;
+				}
+				
+				count = entries;
+				break;
+			}
+			
+			if(fat_is_free_entry(dir))
+			{
+				lfn_match_reset(&match);
+				
+				if(!scan->space)
+				{
+					if(count == 0)
+					{
+						scan->free.sector = sector;
+						scan->free.entry = entry;
+					}
+					
+					if(++count == entries)
+					{
+						scan->space = 1;
+					}
+				}
+				
+				continue;
+			}
+			
+			count = 0;
+			
+			if(fat_is_lfn_entry(dir))
+			{
+				lfn_match_add(&match, dir);
+				continue;
+			}
+			
+			if(fat_is_sfn_entry(dir))
+			{
+				if(lfn_match_sfn(&match, dir))
+				{
+					scan->exists = 1;
+					scan->found.sector = sector;
+					scan->found.entry = entry;
+					
+					return 1;
+				}
+				
+				fat_mark_tail(dir, filename, 1, scan->tails);
+			}
+			
+			lfn_match_reset(&match);
+		}
+		
+		if(entry < 16)
+		{
+			break;
+		}
+	}
+	
+	if(scan->space)
+	{
+		return 1;
+	}
+	
+	// The run starts after the last used entry
+	if(count == 0)
+	{
+		scan->free.sector = sector;
+		scan->free.entry = 0;
+	}
+	
+	// The FAT16 root directory can not be extended
+	if(FAT_IS_FAT16(sdcard) && startcluster == 0)
+	{
+		scan->space = ((((uint32_t)scan->free.sector << 4) + scan->free.entry + entries) <= ((uint32_t)sdcard->rootdir_sectors << 4));
+	}
+	else
+	{
+		scan->space = 1;
+	}
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Load a directory sector to write entries to
+* A sector past the end of the directory starts a new cluster, which
+* is appended to the directory and cleared.
+*
+* @param sdcard			SD Card structure
+* @param cluster			The cluster of the directory
+* @param sector			Sector offset in the directory
+*
+*/
+static uint8_t fat_load_dir_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector)
+{
+	uint32_t lastcluster;
+	uint32_t nextcluster;
+	uint32_t clusters;
+	
+	if(fat_read_sector(sdcard, cluster, sector))
+	{
+		return 1;
+	}
+	
+	// The FAT16 root directory has a fixed size, and a directory
+	// can only be extended by a whole cluster
+	if((FAT_IS_FAT16(sdcard) && cluster == 0) || (sector & sdcard->cluster_mask))
+	{
+		return 0;
+	}
+	
+	printf("Extending directory at sector %lu\n", (unsigned long)sector);
+	
+	// Last cluster of the directory, the sector has to follow it
+	lastcluster = cluster;
+	clusters = 1;
+	
+	while((nextcluster = fat_get_next_cluster(sdcard, lastcluster)) != 0xFFFFFFFF)
+	{
+		if(nextcluster == 0)
+		{
+			return 0;
+		}
+		
+		lastcluster = nextcluster;
+		clusters++;
+	}
+	
+	if(clusters != (sector >> sdcard->cluster_shift))
+	{
+		return 0;
+	}
+	
+	if(!fat_allocate_clusters(sdcard, lastcluster, 1, &nextcluster) || !fat_clear_clusters(sdcard, nextcluster, 1))
+	{
+		return 0;
+	}
+	
+	// The cleared buffer is the first sector of the new cluster
+	sdcard->loaded_sector = fat_get_cluster_sector(sdcard, nextcluster);
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Fill a short name entry
+*
+* @param dir				Entry to fill
+* @param sfn				Short name, 11 characters
+* @param attr				Attributes
+* @param cluster			First cluster
+*
+*/
+static void fat_set_short_entry(dir_short_t *dir, const char *sfn, uint8_t attr, uint32_t cluster)
+{
+	uint8_t i;
+	
+	for(i=0; i<11; i++)
+		dir->DIR_Name[i] = sfn[i];
+
+	dir->DIR_Attr = attr;
+	dir->DIR_NTRes = 0;
+	dir->DIR_CrtTimeTenth = 0x00;
+	dir->DIR_CrtTime = 0x00;
+	dir->DIR_CrtDate = 0x00;
+	dir->DIR_LstAccDate = 0x00;
+	dir->DIR_FstClusHI = (uint16_t)((cluster >> 16) & 0xFFFF);
+	dir->DIR_WrtTime = 0x00;
+	dir->DIR_WrtDate = 0x2011;
+	dir->DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
+	dir->DIR_FileSize = 0x00;
+}
+
+
+/*******************************************************************
+* Create a directory entry if the name does not exist
+* The directory is scanned once, the entries are written to the
+* first run of free entries and the directory is extended if there
+* is none.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster to create the entry in (rootdir or directory)
+* @param filename			Longname of the entry to create
+* @param source			Entry to take the attributes, first cluster, size and
+*							times from, NULL to allocate a cluster for a new file.
+*							Its chain is not freed when creating the entry fails.
+* @param location		Set to the location of the short name entry (optional)
+*
+*/
+static uint8_t fat_create_entry(sdcard_t *sdcard, uint32_t startcluster, const char * filename, const dir_short_t *source, fat_entry *location)
+{
+	fat_dir_scan scan;
+	fat_entry entry;
+	lfn_cache lfn;
+	dir_short_t *dir;
+	dir_long_t *ldir;
+	uint8_t entries, entrynum;
+	uint8_t allocated = 0;
+	uint8_t i;
+	uint32_t cluster = 0;
+	char sfn[13];
+#if FAT_DIR_INDEX
+	fat_dir_index *index;
+	uint32_t position;
+#endif
+
+	if(strlen(filename) == 0)
+	{
+		return 0;
+	}
+	
+	// Long name entries and the short name entry
+	entries = ((strlen(filename) + 12) / 13) + 1;
+	
+	// Existing name, free entries and used tails in one scan
+	if(!fat_scan_directory(sdcard, startcluster, filename, entries, &scan))
+	{
+		return 0;
+	}
+	
+	if(scan.exists)
+	{
+		printf("File already exists\n");
+		return 0;
+	}
+	
+	if(!scan.space)
+	{
+		printf("No free entries\n");
+		return 0;
+	}
+	
+	//
+	// Create shortname, the directory is only scanned again if
+	// every tail of the first window is used
+	//
+	if(!fat_pick_tail(filename, 1, scan.tails, sfn) && !fat_find_free_tail(sdcard, startcluster, filename, 1 + FAT_SFN_TAIL_WINDOW, sfn))
+	{
+		printf("Unable to find a free SFN\n");
+		return 0;
+	}
+	
+	printf("SFN: %s\n", sfn);
+	
+	// Find a free cluster for the file
+	if(source == NULL)
+	{
+		cluster = fat_ring_pop(sdcard);
+	
+		if(cluster == 0)
+		{
+			cluster = fat_get_next_free_cluster(sdcard, fat_get_allocation_start(sdcard, 0, 1, 0));
+		}
+	
+		// No free clusters
+		if(cluster == 0)
+		{
+			printf("Unable to get next free cluster\n");
+			return 0;
+		}	
+	
+		printf("Creating file in cluster: %lu\n", (unsigned long)cluster);
+	
+		// Mark cluster as end of chain before the directory can be
+		// extended, so the extension does not take the same cluster
+		if(!fat_set_next_cluster(sdcard, cluster, 0xFFFFFFFF))
+		{
+			return 0;
+		}
+	
+		fat_cluster_allocated(sdcard, cluster);
+		allocated = 1;
+	}
+	
+	// Update the LFN cache
+	lfn_cache_from_string(&lfn, filename, sfn_checksum(sfn));
+	
+	// Create the file
+	printf("Ready to create file\n");
+	
+	entry = scan.free;
+#if FAT_DIR_INDEX
+	position = (entry.sector << 4) | entry.entry;
+#endif
+	
+	// Create long name entries
+	for(entrynum = lfn.strings; entrynum > 0; entrynum--)
+	{
+		printf("Creating LFN entry: %d\n", entrynum);
+		
+		if(entry.entry >= 16)
+		{
+			entry.entry = 0;
+			entry.sector++;
+		}
+		
+		if(!fat_load_dir_sector(sdcard, entry.cluster, entry.sector))
+		{
+			printf("Failed to read sector for LFN\n");
+			if(allocated) { fat_free_cluster_chain(sdcard, cluster, 0); }
+			return 0;
+		}
+		
+		ldir = (dir_long_t *)(sdcard->buffer + (entry.entry * 32));
+		
+		ldir->LDIR_Ord = (entrynum == lfn.strings ? ((entrynum) | 0x40) : (entrynum));
+		ldir->LDIR_Attr = ATTR_LONG_NAME;
+		ldir->LDIR_Type = 0x00;
+		ldir->LDIR_Chksum = lfn.checksum;
+		ldir->LDIR_FstClusLO = 0x00;
+		
+		memset(ldir->LDIR_Name1, 0x00, 10);
+		memset(ldir->LDIR_Name2, 0x00, 12);
+		memset(ldir->LDIR_Name3, 0x00, 4);
+		
+		ldir->LDIR_Name1[0] = lfn.filename[entrynum-1][0];
+		ldir->LDIR_Name1[2] = lfn.filename[entrynum-1][1];
+		ldir->LDIR_Name1[4] = lfn.filename[entrynum-1][2];
+		ldir->LDIR_Name1[6] = lfn.filename[entrynum-1][3];
+		ldir->LDIR_Name1[8] = lfn.filename[entrynum-1][4];
+		
+		ldir->LDIR_Name2[0] = lfn.filename[entrynum-1][5];
+		ldir->LDIR_Name2[2] = lfn.filename[entrynum-1][6];
+		ldir->LDIR_Name2[4] = lfn.filename[entrynum-1][7];
+		ldir->LDIR_Name2[6] = lfn.filename[entrynum-1][8];
+		ldir->LDIR_Name2[8] = lfn.filename[entrynum-1][9];
+		ldir->LDIR_Name2[10] = lfn.filename[entrynum-1][10];
+		
+		ldir->LDIR_Name3[0] = lfn.filename[entrynum-1][11];
+		ldir->LDIR_Name3[2] = lfn.filename[entrynum-1][12];
+		
+		if(!fat_write_sector(sdcard, entry.cluster, entry.sector, 0))
+		{
+			printf("Failed to write sector for LFN\n");
+			if(allocated) { fat_free_cluster_chain(sdcard, cluster, 0); }
+			return 0;
+		}
+		
+		entry.entry++;
+	}
+	
+	// Increment entry
+	if(entry.entry >= 16)
+	{
+		entry.entry = 0;
+		entry.sector++;
+	}
+	
+	// Create SFN entry
+	if(!fat_load_dir_sector(sdcard, entry.cluster, entry.sector))
+	{
+		printf("Failed to read sector for SFN\n");
+		if(allocated) { fat_free_cluster_chain(sdcard, cluster, 0); }
+		return 0;
+	}
+	
+	dir = (dir_short_t *)(sdcard->buffer + (entry.entry * 32));
+	
+	// Set directory parameters and write
+	if(source == NULL)
+	{
+		fat_set_short_entry(dir, sfn, ATTR_ARCHIVE, cluster);
+	}
+	else
+	{
+		*dir = *source;
+		
+		for(i=0; i<11; i++)
+			dir->DIR_Name[i] = sfn[i];
+		
+		dir->DIR_NTRes = 0;
+	}
+	
+	if(!fat_write_sector(sdcard, entry.cluster, entry.sector, 0))
+	{
+		printf("Failed to write sector for SFN\n");
+		if(allocated) { fat_free_cluster_chain(sdcard, cluster, 0); }
+		return 0;
+	}
+	
+#if FAT_DIR_INDEX
+	// Keep the index of the directory complete
+	index = fat_index_get(sdcard, startcluster, 0);
+	
+	if(index != NULL && !fat_index_insert(index, fat_name_hash(filename, 255), (position > 0xFFFF ? FAT_INDEX_EMPTY : position)))
+	{
+		fat_dir_index_forget(sdcard, startcluster);
+	}
+#endif
+	
+	if(location != NULL)
+	{
+		*location = entry;
+	}
+	
+	printf("File created\n");		
+	return 1;
+}
+
+
+/*******************************************************************
+* Create a file if it does not exist
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster to create the file in (rootdir or directory)
+* @param filename			Longname of the file to create
+* @param location		Set to the location of the short name entry (optional)
+*
+*/
+uint8_t fat_create_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename, fat_entry *location)
+{
+	return fat_create_entry(sdcard, startcluster, filename, NULL, location);
+}
+
+
+/*******************************************************************
+* Create a directory if the name does not exist
+* Clusters for the dot entries and "entries" more are allocated up
+* front, contiguous when possible, and cleared with multiple block
+* writes, so files created in the directory later do not have to
+* extend its chain. The clusters are ready before the entry is written
+* to the parent, they are freed again if the name exists.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster of the parent directory (rootdir or directory)
+* @param dirname			Longname of the directory to create
+* @param entries			Directory entries to make room for
+*
+*/
+uint8_t fat_create_directory(sdcard_t *sdcard, uint32_t startcluster, const char * dirname, uint16_t entries)
+{
+	dir_short_t *dir;
+	dir_short_t source;
+	uint32_t clusters;
+	uint32_t first;
+	uint32_t last;
+	
+	if(strlen(dirname) == 0)
+	{
+		return 0;
+	}
+	
+	// Dot entries and the entries asked for, in whole clusters
+	clusters = ((((uint32_t)entries + 2) << 5) + ((uint32_t)sdcard->blocksize << sdcard->cluster_shift) - 1) >> (sdcard->sector_shift + sdcard->cluster_shift);
+	
+	if(!fat_allocate_range(sdcard, 0, clusters, 1, 0, &first, &last) && !fat_allocate_range(sdcard, 0, clusters, 0, 0, &first, &last))
+	{
+		printf("Unable to allocate %lu clusters\n", (unsigned long)clusters);
+		return 0;
+	}
+	
+	printf("Creating directory in cluster: %lu\n", (unsigned long)first);
+	
+	if(!fat_clear_chain_data(sdcard, first))
+	{
+		fat_free_cluster_chain(sdcard, first, 0);
+		return 0;
+	}
+	
+	// "." and "..", the root directory is cluster 0 in ".."
+	sdcard->loaded_sector = -1;
+	memset(sdcard->buffer, 0x00, sdcard->blocksize);
+	
+	dir = (dir_short_t *)sdcard->buffer;
+	fat_set_short_entry(&dir[0], ".          ", ATTR_DIRECTORY, first);
+	fat_set_short_entry(&dir[1], "..         ", ATTR_DIRECTORY, (startcluster == sdcard->rootdir_begin_cluster ? 0 : startcluster));
+	
+	if(!sd_write_block(sdcard, fat_get_cluster_sector(sdcard, first), 0))
+	{
+		fat_free_cluster_chain(sdcard, first, 0);
+		return 0;
+	}
+	
+	fat_set_short_entry(&source, "           ", ATTR_DIRECTORY, first);
+	
+	if(!fat_create_entry(sdcard, startcluster, dirname, &source, NULL))
+	{
+		fat_free_cluster_chain(sdcard, first, 0);
+		return 0;
+	}
+	
+	printf("Directory created\n");
+	return 1;
+}
+
+
+/*******************************************************************
+* Mark the entries of a name as deleted, the short name entry and the
+* long name entries before it. The short name entry is written last.
+*
+* @param sdcard			SD Card structure
+* @param found			Location of the short name entry
+* @param entries			Number of entries of the name
+*
+*/
+static uint8_t fat_remove_entries(sdcard_t *sdcard, fat_entry *found, uint8_t entries)
+{
+	uint32_t position;
+	uint32_t first;
+	uint32_t sector;
+	uint8_t entry;
+	
+	position = (found->sector << 4) | found->entry;
+	
+	if(position + 1 < entries)
+	{
+		return 0;
 	}
 	
-	count = 0;
-	firstentry->cluster = startcluster;
-	firstentry->sector = 0;
-	firstentry->entry = 0;
+	first = position + 1 - entries;
 	
-	// Start cluster
-	sector = 0;
-	
-	while(1)
+	for(sector = (first >> 4); sector <= found->sector; sector++)
 	{
-		if(!fat_read_sector(sdcard, startcluster, sector))
+		if(!fat_read_sector(sdcard, found->cluster, sector))
 		{
-			free(firstentry);
 			return 0;
 		}
 		
-		printf("Reading cluster: %ld -> %ld\n", startcluster, sector);
-		
-		//
-		// Loop directory entries in this sector
-		//
 		for(entry = 0; entry < 16; entry++)
 		{
-			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
-			
-			// Free entry
-			if(fat_is_last_entry(dir) || fat_is_free_entry(dir))
-			{
-				// First valid
-				if(count == 0)
-				{
-					firstentry->sector = sector;
-					firstentry->entry = entry;
-				}
-				
-				count++;
-				
-				// We have found the needed number of free entries
-				if(count == entries)
-				{
-					return firstentry;
-				}
-			}
-			// Entry is not free, invalidate
-			else
+			if(((sector << 4) | entry) >= first && ((sector << 4) | entry) <= position)
 			{
-				count = 0;
+				sdcard->buffer[entry * 32] = ENTRY_DELETED;
 			}
 		}
 		
-		// Increment sector
-		sector++;
+		if(!fat_write_sector(sdcard, found->cluster, sector, 0))
+		{
+			return 0;
+		}
 	}
 	
-	printf("End of function\n");
-	free(firstentry);
-	return NULL;
+	return 1;
 }
 
 
-
 /*******************************************************************
-* Find the next file or directory based on a byte offset from the
-* cluster start
-* Used by readdir
+* Check that a directory only holds "." and ".."
 *
 * @param sdcard			SD Card structure
-* @param handle			FAT handle
-* @param lfn				Long file name cache (optional)
+* @param cluster			First cluster of the directory
 *
 */
-dir_short_t * fat_find_next_file(sdcard_t *sdcard, fat_handle *handle, lfn_cache *lfn)
+static uint8_t fat_dir_is_empty(sdcard_t *sdcard, uint32_t cluster)
 {
-	uint32_t cluster;
 	uint32_t sector;
-	uint32_t offset;
+	uint8_t entry;
 	dir_short_t *dir;
 	
-	if(lfn != NULL)
-	{
-		lfn_cache_reset(lfn);
-	}
-	
-	// Start cluster/sector
-	cluster = handle->datacluster;
-	sector = (handle->ptr / sdcard->blocksize);
-	offset = (handle->ptr % sdcard->blocksize);
-	
-	while(1)
+	for(sector = 0; fat_read_sector(sdcard, cluster, sector); sector++)
 	{
-		printf("Reading cluster: %ld -> %ld\n", cluster, sector);
-		if(!fat_read_sector(sdcard, cluster, sector))
-		{
-			return 0;
-		}
-				
-		//
-		// Loop directory entries in this sector
-		//
-		for(; offset < sdcard->blocksize; offset += 32)
+		for(entry = 0; entry < 16; entry++)
 		{
-			dir = (dir_short_t *)(sdcard->buffer + offset);
+			dir = (dir_short_t *)(sdcard->buffer + (entry * 32));
 			
-			// Last entry
 			if(fat_is_last_entry(dir))
 			{
-				if(lfn != NULL)
-				{
-					lfn_cache_reset(lfn);
-				}
-				
-				return 0;
-			}
-			
-			// Increment offset
-			handle->ptr += 32;
-			
-			// Free entry
-			if(fat_is_free_entry(dir))
-			{
-				if(lfn != NULL)
-				{
-					lfn_cache_reset(lfn);
-				}
-				
-				continue;
-			}
-			
-			//
-			// Long name entry
-			//
-			if(fat_is_lfn_entry(dir))
-			{
-				if(lfn != NULL)
-				{
-					lfn_cache_add(lfn, dir);
-				}
-				
-				continue;
+				return 1;
 			}
 			
-			//
-			// Directory or file entry
-			//
-			if(fat_is_sfn_entry(dir))
+			if(fat_is_sfn_entry(dir) && dir->DIR_Name[0] != '.')
 			{
-				return dir;
+				return 0;
 			}
 		}
-		
-		// Reset offset
-		offset = 0;
-
-		// Increment sector
-		sector++;
 	}
 	
-	//printf("End of function\n");
-	return 0;
+	return 1;
 }
 
 
+/*******************************************************************
+* Get the parent of a directory from its ".." entry
+*
+* @param sdcard			SD Card structure
+* @param cluster			First cluster of the directory
+*
+*/
+static uint32_t fat_dir_parent(sdcard_t *sdcard, uint32_t cluster)
+{
+	dir_short_t *dir;
+	
+	if(!fat_read_sector(sdcard, cluster, 0))
+	{
+		return sdcard->rootdir_begin_cluster;
+	}
+	
+	dir = (dir_short_t *)(sdcard->buffer + 32);
+	cluster = (((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO);
+	
+	return (cluster == 0 ? sdcard->rootdir_begin_cluster : cluster);
+}
+
 
 /*******************************************************************
-* Create a file if it does not exist and return it
+* Delete a file or an empty directory
+* Only the directory entries and the FAT are written, the clusters of
+* the file are released without clearing them.
 *
 * @param sdcard			SD Card structure
-* @param startcluster	The cluster to create the file in (rootdir or directory)
-* @param filename			Longname of the file to create
+* @param startcluster	The cluster of the directory holding the file
+* @param filename			Longname of the file
 *
 */
-uint8_t fat_create_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename)
+uint8_t fat_delete_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename)
 {
-	fat_entry * entry;
-	lfn_cache lfn;
+	fat_entry found;
 	dir_short_t *dir;
-	dir_long_t *ldir;
-	uint16_t i;
-	uint8_t entries, entrynum;
 	uint32_t cluster;
-	char sfn[13];
-
+	uint8_t attr;
+	uint8_t entries;
+	
 	if(strlen(filename) == 0)
 	{
 		return 0;
 	}
 	
-	// Attempt to find the file
-	dir = fat_find_lfn(sdcard, startcluster, filename);
-	if(dir != NULL)
+	dir = fat_find_entry(sdcard, startcluster, filename, &found);
+	if(dir == NULL)
 	{
-		printf("File already exists\n");
+		printf("File does not exist\n");
 		return 0;
 	}
 	
-	// Find a free cluster for the file
-	cluster = fat_get_next_free_cluster(sdcard, startcluster);
+	cluster = (((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO);
+	attr = dir->DIR_Attr;
 	
-	// No free clusters
-	if(cluster == 0)
+	if((attr & ATTR_DIRECTORY) && !fat_dir_is_empty(sdcard, cluster))
 	{
-		printf("Unable to get next free cluster\n");
+		printf("Directory not empty\n");
 		return 0;
-	}	
-	
-	printf("Creating file in cluster: %ld\n", cluster);
-
-	//
-	// Create shortname
-	//
-	i = 1;
-	while(i < 65535)
-	{
-		lfn_to_sfn(filename, sfn, i);
-		
-		// This tail number is available
-		if(!fat_find_sfn(sdcard, startcluster, sfn))
-		{
-			break;
-		}
-		
-		i++;
 	}
 	
-	if(i == 65535)
+	// Long name entries and the short name entry
+	entries = ((strlen(filename) + 12) / 13) + 1;
+	
+	if(!fat_remove_entries(sdcard, &found, entries))
 	{
-		printf("Unable to find a free SFN\n");
 		return 0;
 	}
 	
-	printf("SFN: %s\n", sfn);
-	
-	// Update the LFN cache
-	lfn_cache_from_string(&lfn, filename, sfn_checksum(sfn));
-	
-	// How many entries we will need to create
-	// this file
-	entries = lfn.strings + 1;
-	
-	// Find free entry
-	entry = fat_find_free_entry(sdcard, startcluster, entries);
+#if FAT_DIR_INDEX
+	fat_index_remove(sdcard, startcluster, filename, ((found.sector << 4) | found.entry) + 1 - entries);
+#endif
 	
-	if(entry == NULL)
+	if(attr & ATTR_DIRECTORY)
 	{
-		printf("No free entries\n");
-		return 0;
+		fat_dentry_forget(sdcard, cluster);
+		fat_dir_index_forget(sdcard, cluster);
 	}
 	
-	// Create the file
-	printf("Ready to create file\n");
-	
-	// Create long name entries
-	for(entrynum = lfn.strings; entrynum > 0; entrynum--)
+	if(cluster < 2)
 	{
-		printf("Creating LFN entry: %d\n", entrynum);
-		
-		if(entry->entry >= 16)
-		{
-			entry->entry = 0;
-			entry->sector++;
-		}
-		
-		if(!fat_read_sector(sdcard, entry->cluster, entry->sector))
-		{
-			printf("Failed to read sector for LFN\n");
-			return 0;
-		}
-		
-		ldir = (dir_long_t *)(sdcard->buffer + (entry->entry * 32));
-		
-		ldir->LDIR_Ord = (entrynum == lfn.strings ? ((entrynum) | 0x40) : (entrynum));
-		ldir->LDIR_Attr = ATTR_LONG_NAME;
-		ldir->LDIR_Type = 0x00;
-		ldir->LDIR_Chksum = lfn.checksum;
-		ldir->LDIR_FstClusLO = 0x00;
-		
-		memset(ldir->LDIR_Name1, 0x00, 10);
-		memset(ldir->LDIR_Name2, 0x00, 12);
-		memset(ldir->LDIR_Name3, 0x00, 4);
-		
-		ldir->LDIR_Name1[0] = lfn.filename[entrynum-1][0];
-		ldir->LDIR_Name1[2] = lfn.filename[entrynum-1][1];
-		ldir->LDIR_Name1[4] = lfn.filename[entrynum-1][2];
-		ldir->LDIR_Name1[6] = lfn.filename[entrynum-1][3];
-		ldir->LDIR_Name1[8] = lfn.filename[entrynum-1][4];
-		
-		ldir->LDIR_Name2[0] = lfn.filename[entrynum-1][5];
-		ldir->LDIR_Name2[2] = lfn.filename[entrynum-1][6];
-		ldir->LDIR_Name2[4] = lfn.filename[entrynum-1][7];
-		ldir->LDIR_Name2[6] = lfn.filename[entrynum-1][8];
-		ldir->LDIR_Name2[8] = lfn.filename[entrynum-1][9];
-		ldir->LDIR_Name2[10] = lfn.filename[entrynum-1][10];
-		
-		ldir->LDIR_Name3[0] = lfn.filename[entrynum-1][11];
-		ldir->LDIR_Name3[2] = lfn.filename[entrynum-1][12];
-		
-		if(!fat_write_sector(sdcard, entry->cluster, entry->sector, 0))
-		{
-			printf("Failed to write sector for LFN\n");
-			return 0;
-		}
-		
-		entry->entry++;
+		return 1;
 	}
 	
-	// Increment entry
-	if(entry->entry >= 16)
+	return fat_release_chain(sdcard, cluster, 0);
+}
+
+
+/*******************************************************************
+* Rename a file or directory, or move it to another directory
+* The entries of the new name are written before the old ones are
+* deleted, the data of the file is not read or written. The new name
+* must not exist.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster of the directory holding the file
+* @param filename			Longname of the file
+* @param newcluster		The cluster of the directory to move the file to
+* @param newname			New longname of the file
+*
+*/
+uint8_t fat_rename_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename, uint32_t newcluster, const char * newname)
+{
+	fat_entry found;
+	dir_short_t *dir;
+	dir_short_t source;
+	uint32_t cluster;
+	uint32_t parent;
+	uint8_t entries;
+	uint8_t depth;
+	
+	if(strlen(filename) == 0 || strlen(newname) == 0)
 	{
-		entry->entry = 0;
-		entry->sector++;
+		return 0;
 	}
 	
-	// Create SFN entry
-	if(!fat_read_sector(sdcard, entry->cluster, entry->sector))
+	dir = fat_find_entry(sdcard, startcluster, filename, &found);
+	if(dir == NULL)
 	{
-		printf("Failed to read sector for SFN\n");
+		printf("File does not exist\n");
 		return 0;
 	}
 	
-	dir = (dir_short_t *)(sdcard->buffer + (entry->entry * 32));
+	source = *dir;
+	cluster = (((uint32_t)source.DIR_FstClusHI << 16) | source.DIR_FstClusLO);
 	
-	// Set directory parameters and write
-	for(i=0; i<11; i++)
-		dir->DIR_Name[i] = sfn[i];
-
-	dir->DIR_Attr = ATTR_ARCHIVE;
-	dir->DIR_NTRes = 0;
-	dir->DIR_CrtTimeTenth = 0x00;
-	dir->DIR_CrtTime = 0x00;
-	dir->DIR_CrtDate = 0x00;
-	dir->DIR_LstAccDate = 0x00;
-	dir->DIR_FstClusHI = (uint16_t)((cluster >> 16) & 0xFFFF);
-	dir->DIR_WrtTime = 0x00;
-	dir->DIR_WrtDate = 0x2011;
-	dir->DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
-	dir->DIR_FileSize = 0x00;
+	// A directory can not be moved into itself or a directory below it
+	if((source.DIR_Attr & ATTR_DIRECTORY) && newcluster != startcluster)
+	{
+		parent = newcluster;
+		
+		for(depth = 0; parent != sdcard->rootdir_begin_cluster && depth < 255; depth++)
+		{
+			if(parent == cluster)
+			{
+				printf("Can not move a directory into itself\n");
+				return 0;
+			}
+			
+			parent = fat_dir_parent(sdcard, parent);
+		}
+	}
 	
-	if(!fat_write_sector(sdcard, entry->cluster, entry->sector, 0))
+	if(!fat_create_entry(sdcard, newcluster, newname, &source, NULL))
 	{
-		printf("Failed to write sector for SFN\n");
 		return 0;
 	}
 	
-	// Mark cluster as end of chain
-	if(!fat_set_next_cluster(sdcard, cluster, 0xFFFFFFFF))
+	// The old entries have not moved, the new ones were written to free entries
+	entries = ((strlen(filename) + 12) / 13) + 1;
+	
+	if(!fat_remove_entries(sdcard, &found, entries))
 	{
 		return 0;
 	}
 	
-	printf("File created\n");		
+#if FAT_DIR_INDEX
+	fat_index_remove(sdcard, startcluster, filename, ((found.sector << 4) | found.entry) + 1 - entries);
+#endif
+	
+	if(source.DIR_Attr & ATTR_DIRECTORY)
+	{
+		fat_dentry_forget(sdcard, cluster);
+		
+		// Point ".." at the new parent
+		if(newcluster != startcluster)
+		{
+			if(!fat_read_sector(sdcard, cluster, 0))
+			{
+				return 0;
+			}
+			
+			dir = (dir_short_t *)(sdcard->buffer + 32);
+			parent = (newcluster == sdcard->rootdir_begin_cluster ? 0 : newcluster);
+			dir->DIR_FstClusHI = (uint16_t)((parent >> 16) & 0xFFFF);
+			dir->DIR_FstClusLO = (uint16_t)(parent & 0xFFFF);
+			
+			if(!fat_write_sector(sdcard, cluster, 0, 0))
+			{
+				return 0;
+			}
+		}
+	}
+	
 	return 1;
 }
 
@@ -1434,11 +4386,11 @@ uint8_t fat_truncate_file(sdcard_t *sdcard, uint32_t startcluster, const char *
 		return 0;
 	}	
 	
-	// Free cluster chain and clear data
-	fat_free_cluster_chain(sdcard, cluster, 1);
+	// Clear data and free the cluster chain, the first cluster is
+	// kept as end of chain
+	fat_clear_chain_data(sdcard, cluster);
 	
-	// Mark first cluster as end of chain
-	if(!fat_set_next_cluster(sdcard, cluster, 0xFFFFFFFF))
+	if(!fat_release_chain(sdcard, cluster, 1))
 	{
 		return 0;
 	}
@@ -1450,25 +4402,33 @@ uint8_t fat_truncate_file(sdcard_t *sdcard, uint32_t startcluster, const char *
 
 
 /*******************************************************************
-* Read data from a file into a buffer
+* Preallocate clusters so the file can grow to "bytes" without any
+* further allocation. The new clusters are one contiguous run, and the
+* file size is left unchanged. The chain of an empty file is replaced
+* so the whole file becomes contiguous.
+*
+* @param sdcard			SD Card structure
+* @param startcluster	The cluster of the directory holding the file
+* @param filename			Longname of the file
+* @param bytes				Size to reserve space for
+* @param firstcluster	Set to the first cluster of the file
+*
 */
-uint32_t fat_read_file(sdcard_t * sdcard, uint32_t startcluster, const char * filename, void * buffer, uint32_t start, uint32_t bytes)
+uint8_t fat_preallocate_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename, uint32_t bytes, uint32_t *firstcluster)
 {
 	dir_short_t *dir;
-	uint32_t cluster;
-	uint32_t sector;
-	uint32_t filesize;
-	uint32_t offset;
-	uint32_t bytesread;
-	uint32_t bytestoread;
-	
+	uint32_t cluster, filesize;
+	uint32_t clustersize;
+	uint32_t clusters;
+	uint32_t needed;
+	uint32_t lastcluster;
+	uint32_t nextcluster;
+
 	if(strlen(filename) == 0)
+	{
 		return 0;
+	}
 	
-	if(bytes == 0)
-		return 0;
-	
-	// Attempt to find the file
 	dir = fat_find_lfn(sdcard, startcluster, filename);
 	if(dir == NULL)
 	{
@@ -1476,7 +4436,150 @@ uint32_t fat_read_file(sdcard_t * sdcard, uint32_t startcluster, const char * fi
 		return 0;
 	}
 	
+	cluster = (((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO);
 	filesize = dir->DIR_FileSize;
+	*firstcluster = cluster;
+	
+	clustersize = (uint32_t)1 << (sdcard->sector_shift + sdcard->cluster_shift);
+	needed = (bytes + clustersize - 1) >> (sdcard->sector_shift + sdcard->cluster_shift);
+	
+	if(needed == 0)
+	{
+		return 1;
+	}
+	
+	//
+	// Empty file, allocate a new chain for the whole file
+	//
+	if(filesize == 0)
+	{
+		if(!fat_allocate_contiguous(sdcard, 0, needed, &nextcluster))
+		{
+			return 0;
+		}
+		
+		dir = fat_find_lfn(sdcard, startcluster, filename);
+		if(dir == NULL)
+		{
+			return 0;
+		}
+		
+		dir->DIR_FstClusHI = (uint16_t)((nextcluster >> 16) & 0xFFFF);
+		dir->DIR_FstClusLO = (uint16_t)(nextcluster & 0xFFFF);
+		
+		if(!sd_write_block(sdcard, sdcard->loaded_sector, 0))
+		{
+			return 0;
+		}
+		
+		// Release the old chain
+		if(cluster != 0)
+		{
+			fat_free_cluster_chain(sdcard, cluster, 0);
+		}
+		
+		*firstcluster = nextcluster;
+		return 1;
+	}
+	
+	//
+	// Extend the existing chain with a contiguous run
+	//
+	clusters = 1;
+	lastcluster = cluster;
+	
+	while(clusters < needed)
+	{
+		nextcluster = fat_get_next_cluster(sdcard, lastcluster);
+		
+		if(nextcluster == 0xFFFFFFFF || nextcluster == 0)
+		{
+			break;
+		}
+		
+		lastcluster = nextcluster;
+		clusters++;
+	}
+	
+	// Already large enough
+	if(clusters >= needed)
+	{
+		return 1;
+	}
+	
+	return fat_allocate_contiguous(sdcard, lastcluster, (needed - clusters), &nextcluster);
+}
+
+
+/*******************************************************************
+* Count the clusters of a chain if it is one contiguous run
+* Walks the chain once, returns 0 if the chain is fragmented.
+*
+* @param sdcard		SD Card structure
+* @param cluster		First cluster of the chain
+*
+*/
+uint32_t fat_get_contiguous_clusters(sdcard_t *sdcard, uint32_t cluster)
+{
+	uint32_t clusters;
+	uint32_t nextcluster;
+	
+	if(cluster < 2)
+	{
+		return 0;
+	}
+	
+	clusters = 1;
+	
+	while(1)
+	{
+		nextcluster = fat_get_next_cluster(sdcard, cluster);
+		
+		// End of chain
+		if(nextcluster == 0xFFFFFFFF)
+		{
+			return clusters;
+		}
+		
+		// Fragmented or broken chain
+		if(nextcluster != cluster + 1)
+		{
+			return 0;
+		}
+		
+		cluster = nextcluster;
+		clusters++;
+	}
+}
+
+
+/*******************************************************************
+* Read data from a file into a buffer
+* The first cluster and the size are taken from the handle, the
+* directory is not searched. Sectors within the handle's contiguous
+* clusters are calculated without FAT lookups.
+*
+* @param sdcard		SD Card structure
+* @param handle		Handle of the open file
+* @param buffer		Buffer to read to
+* @param start		Byte offset in the file
+* @param bytes		Number of bytes to read
+*
+*/
+uint32_t fat_read_file(sdcard_t * sdcard, fat_handle *handle, void * buffer, uint32_t start, uint32_t bytes)
+{
+	uint32_t cluster;
+	uint32_t sector;
+	uint32_t filesize;
+	uint32_t offset;
+	uint32_t bytesread;
+	uint32_t bytestoread;
+	uint32_t directsectors;
+	
+	if(bytes == 0)
+		return 0;
+	
+	filesize = handle->filesize;
 	
 	if(filesize == 0 || start >= filesize)
 	{
@@ -1487,15 +4590,25 @@ uint32_t fat_read_file(sdcard_t * sdcard, uint32_t startcluster, const char * fi
 	//
 	// Sector to start reading from, determined by the start offset
 	//
-	cluster = ((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
-	sector = (start / sdcard->blocksize);
-	offset = start - (sector * sdcard->blocksize);
+	cluster = handle->datacluster;
+	sector = (start >> sdcard->sector_shift);
+	offset = (start & sdcard->sector_mask);
 	bytesread = 0;
 	
+	// Sectors that can be addressed directly
+	directsectors = handle->contiguous << sdcard->cluster_shift;
+	
 	while(bytesread < bytes)
 	{
 		// Read the sector
-		if(!fat_read_sector(sdcard, cluster, sector))
+		if(sector < directsectors)
+		{
+			if(!sd_read_block(sdcard, fat_get_cluster_sector(sdcard, cluster) + sector, 0))
+			{
+				return bytesread;
+			}
+		}
+		else if(!fat_read_sector(sdcard, cluster, sector))
 		{
 			return bytesread;
 		}
@@ -1510,7 +4623,7 @@ uint32_t fat_read_file(sdcard_t * sdcard, uint32_t startcluster, const char * fi
 		// Check that we dont read past the file end
 		if((start + bytesread + bytestoread) > filesize)
 		{
-			bytestoread = (filesize - (start - bytesread));
+			bytestoread = (filesize - (start + bytesread));
 		}
 		
 		// Copy data to buffer
@@ -1538,8 +4651,19 @@ uint32_t fat_read_file(sdcard_t * sdcard, uint32_t startcluster, const char * fi
 
 /*******************************************************************
 * Write data to a file from a buffer
+* The first cluster, size, contiguous cluster count and allocation
+* window are taken from the handle and updated when the file grows.
+* The size in the directory entry is patched in place at the
+* location recorded by fat_fopen(), the directory is not searched.
+*
+* @param sdcard		SD Card structure
+* @param handle		Handle of the open file
+* @param buffer		Buffer to write from
+* @param start		Byte offset in the file
+* @param bytes		Number of bytes to write
+*
 */
-uint32_t fat_write_file(sdcard_t * sdcard, uint32_t startcluster, const char * filename, void * buffer, uint32_t start, uint32_t bytes)
+uint32_t fat_write_file(sdcard_t * sdcard, fat_handle *handle, void * buffer, uint32_t start, uint32_t bytes)
 {
 	dir_short_t *dir;
 	uint32_t cluster;
@@ -1548,22 +4672,24 @@ uint32_t fat_write_file(sdcard_t * sdcard, uint32_t startcluster, const char * f
 	uint32_t offset;
 	uint32_t byteswritten;
 	uint32_t bytestowrite;
-	
-	if(strlen(filename) == 0)
-		return 0;
+	uint32_t target_sector;
+	uint32_t directsectors;
+	uint32_t clustersize;
+	uint32_t clusters;
+	uint32_t needed;
+	uint32_t lastcluster;
+	uint32_t firstcluster;
+	uint32_t nextcluster;
+	uint32_t contiguous;
+	fat_window *window;
+	uint8_t newchain;
 	
 	if(bytes == 0)
 		return 0;
 	
-	// Attempt to find the file
-	dir = fat_find_lfn(sdcard, startcluster, filename);
-	if(dir == NULL)
-	{
-		printf("File does not exist\n");
-		return 0;
-	}
-	
-	filesize = dir->DIR_FileSize;
+	filesize = handle->filesize;
+	contiguous = handle->contiguous;
+	window = &handle->window;
 	
 	// Cannot start writing past the end of file
 	if(start > filesize)
@@ -1574,34 +4700,145 @@ uint32_t fat_write_file(sdcard_t * sdcard, uint32_t startcluster, const char * f
 	//
 	// Sector to start writing to from, determined by the start offset
 	//
-	cluster = ((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
-	sector = (start / sdcard->blocksize);
-	offset = start - (sector * sdcard->blocksize);
+	cluster = handle->datacluster;
+	sector = (start >> sdcard->sector_shift);
+	offset = (start & sdcard->sector_mask);
 	byteswritten = 0;
 	
-	while(byteswritten < bytes)
+	//
+	// Make sure the cluster chain covers the whole write, all missing
+	// clusters are allocated at once
+	//
+	clustersize = (uint32_t)1 << (sdcard->sector_shift + sdcard->cluster_shift);
+	needed = ((start + bytes) + clustersize - 1) >> (sdcard->sector_shift + sdcard->cluster_shift);
+	newchain = 0;
+	
+	// Empty file without a cluster
+	if(cluster == 0)
 	{
-		// Read the sector
-		if(!fat_read_sector(sdcard, cluster, sector))
+		if(!fat_allocate_window(sdcard, window, 0, needed, &cluster, &lastcluster))
 		{
-			return byteswritten;
+			return 0;
 		}
-
+		
+		contiguous = ((lastcluster - cluster + 1) == needed ? needed : 0);
+		newchain = 1;
+	}
+	// Contiguous file, the chain length is known
+	else if(contiguous > 0)
+	{
+		if(contiguous < needed)
+		{
+			lastcluster = cluster + contiguous - 1;
+			
+			if(!fat_allocate_window(sdcard, window, lastcluster, (needed - contiguous), &firstcluster, &nextcluster))
+			{
+				needed = contiguous;
+			}
+			// The file stays contiguous if the new run follows the old one
+			else if(firstcluster == lastcluster + 1 && (nextcluster - lastcluster) == (needed - contiguous))
+			{
+				contiguous = needed;
+			}
+			else
+			{
+				contiguous = 0;
+			}
+		}
+	}
+	else
+	{
+		clusters = 1;
+		lastcluster = cluster;
+		
+		while(clusters < needed)
+		{
+			nextcluster = fat_get_next_cluster(sdcard, lastcluster);
+			
+			if(nextcluster == 0xFFFFFFFF || nextcluster == 0)
+			{
+				break;
+			}
+			
+			lastcluster = nextcluster;
+			clusters++;
+		}
+		
+		if(clusters < needed && !fat_allocate_window(sdcard, window, lastcluster, (needed - clusters), &firstcluster, &nextcluster))
+		{
+			needed = clusters;
+		}
+	}
+	
+	// Out of space, only write up to the end of the chain
+	if((start + bytes) > (needed * clustersize))
+	{
+		if(start >= (needed * clustersize))
+		{
+			return 0;
+		}
+		
+		bytes = (needed * clustersize) - start;
+	}
+	
+	handle->contiguous = contiguous;
+	
+	// Sectors that can be addressed directly
+	directsectors = contiguous << sdcard->cluster_shift;
+	
+	while(byteswritten < bytes)
+	{
 		// Bytes to write to this sector
 		bytestowrite = (bytes - byteswritten);
 		if(bytestowrite > (sdcard->blocksize - offset))
 		{
 			bytestowrite = (sdcard->blocksize - offset);
 		}
-				
-		// Copy and write data
-		if(bytestowrite > 0)
+		
+		//
+		// Contiguous file, no FAT lookups needed
+		//
+		if(sector < directsectors)
+		{
+			target_sector = fat_get_cluster_sector(sdcard, cluster) + sector;
+			
+			// The whole sector is replaced, no need to read it first
+			if(bytestowrite == sdcard->blocksize)
+			{
+				sdcard->loaded_sector = -1;
+			}
+			else if(!sd_read_block(sdcard, target_sector, 0))
+			{
+				break;
+			}
+			
+			memcpy((sdcard->buffer + offset), (buffer + byteswritten), bytestowrite);
+			
+			sdcard->loaded_sector = -1;
+			
+			if(!sd_write_block(sdcard, target_sector, 0))
+			{
+				break;
+			}
+			
+			sdcard->loaded_sector = target_sector;
+		}
+		//
+		// Follow the cluster chain
+		//
+		else
 		{
+			// Read the sector
+			if(!fat_read_sector(sdcard, cluster, sector))
+			{
+				break;
+			}
+			
 			memcpy((sdcard->buffer + offset), (buffer + byteswritten), bytestowrite);
 			
 			if(!fat_write_sector(sdcard, cluster, sector, 1))
 			{
-				return byteswritten;
+				break;
 			}
 		}
 		
@@ -1609,32 +4846,41 @@ uint32_t fat_write_file(sdcard_t * sdcard, uint32_t startcluster, const char * f
 		byteswritten += bytestowrite;
 		offset = 0;
 		sector++;
-		
-		// Bytes to write is 0, which means we are done
-		if(bytestowrite == 0)
-		{
-			break;
-		}
 	}
 	
 	// Update file entry
-	if(byteswritten > 0)
+	if(byteswritten > 0 || newchain)
 	{
-		dir = fat_find_lfn(sdcard, startcluster, filename);
-		if(dir == NULL)
+		if(newchain)
+		{
+			handle->datacluster = cluster;
+		}
+		
+		if(start + byteswritten > filesize)
+		{
+			handle->filesize = (start + byteswritten);
+		}
+		
+		// Patch the directory entry in place
+		if(!sd_read_block(sdcard, handle->entrysector, 0))
 		{
 			return 0;
 		}
 		
+		dir = (dir_short_t *)(sdcard->buffer + (handle->entryindex * 32));
+		
 		// TODO: Update last access time?
 		
-		// Update file size
-		if(start + byteswritten > filesize)
-		{		
-			dir->DIR_FileSize = (start + byteswritten);
+		// First cluster of a previously empty file
+		if(newchain)
+		{
+			dir->DIR_FstClusHI = (uint16_t)((cluster >> 16) & 0xFFFF);
+			dir->DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
 		}
 		
-		if(!sd_write_block(sdcard, sdcard->loaded_sector, 0))
+		dir->DIR_FileSize = handle->filesize;
+		
+		if(!sd_write_block(sdcard, handle->entrysector, 0))
 		{
 			return 0;
 		}
@@ -40,9 +40,90 @@
 #define ATTR_FREE			0xE5
 #define ATTR_LAST_LONG	0x40
 
+// Longest long name plus the terminator
+#define FAT_NAME_SIZE	256
+
 #define FAT16	16
 #define FAT32	32
 
+// Build with FAT_ONLY_FAT16 or FAT_ONLY_FAT32 to leave out the other type
+#if defined(FAT_ONLY_FAT16) && defined(FAT_ONLY_FAT32)
+	#error "FAT_ONLY_FAT16 and FAT_ONLY_FAT32 can not both be set"
+#elif defined(FAT_ONLY_FAT16)
+	#define FAT_IS_FAT16(sdcard)	1
+#elif defined(FAT_ONLY_FAT32)
+	#define FAT_IS_FAT16(sdcard)	0
+#else
+	#define FAT_IS_FAT16(sdcard)	((sdcard)->fattype == FAT16)
+#endif
+
+// Keep a hashed name index of recently used directories in RAM, see
+// fat_find_lfn(). Each index takes 4 bytes of heap per slot, which is
+// meant for external RAM. Lookups fall back to a directory scan when the
+// allocation fails or a directory has too many names.
+#ifndef FAT_DIR_INDEX
+	#define FAT_DIR_INDEX			1
+#endif
+
+// Slots a directory index starts with, a power of two
+#ifndef FAT_DIR_INDEX_SLOTS
+	#define FAT_DIR_INDEX_SLOTS	1024
+#endif
+
+// Slots a directory index may grow to, a power of two up to 32768.
+// A directory can hold 3/4 of this in long names and still be indexed.
+#ifndef FAT_DIR_INDEX_MAX_SLOTS
+	#define FAT_DIR_INDEX_MAX_SLOTS	4096
+#endif
+
+#if (FAT_DIR_INDEX_SLOTS & (FAT_DIR_INDEX_SLOTS - 1)) != 0 || (FAT_DIR_INDEX_MAX_SLOTS & (FAT_DIR_INDEX_MAX_SLOTS - 1)) != 0
+	#error "FAT_DIR_INDEX_SLOTS and FAT_DIR_INDEX_MAX_SLOTS must be powers of two"
+#endif
+
+#if FAT_DIR_INDEX_MAX_SLOTS < FAT_DIR_INDEX_SLOTS || FAT_DIR_INDEX_MAX_SLOTS > 32768
+	#error "FAT_DIR_INDEX_MAX_SLOTS must be between FAT_DIR_INDEX_SLOTS and 32768"
+#endif
+
+// Directories with an index at the same time
+#ifndef FAT_DIR_INDEX_DIRS
+	#define FAT_DIR_INDEX_DIRS		2
+#endif
+
+// Directories remembered as not indexable, a few bytes of heap each
+#ifndef FAT_DIR_NOINDEX_DIRS
+	#define FAT_DIR_NOINDEX_DIRS	4
+#endif
+
+#if FAT_DIR_INDEX_DIRS < 1 || FAT_DIR_NOINDEX_DIRS < 1
+	#error "FAT_DIR_INDEX_DIRS and FAT_DIR_NOINDEX_DIRS must be at least 1"
+#endif
+
+// Short name tail numbers (~n) checked per directory scan when creating files
+#ifndef FAT_SFN_TAIL_WINDOW
+	#define FAT_SFN_TAIL_WINDOW	256
+#endif
+
+// FAT sectors to search past the first free clusters for a contiguous run
+#ifndef FAT_ALLOC_SEARCH_SECTORS
+	#define FAT_ALLOC_SEARCH_SECTORS	64
+#endif
+
+// Start large and preallocated allocations in empty SD allocation units,
+// 0 to disable
+#ifndef FAT_ALLOC_AU
+	#define FAT_ALLOC_AU					1
+#endif
+
+// Clusters reserved ahead for each file open for writing, 0 to disable
+#ifndef FAT_ALLOC_WINDOW
+	#define FAT_ALLOC_WINDOW			16
+#endif
+
+// Allocation units to check for an empty one before giving up
+#ifndef FAT_AU_SEARCH_UNITS
+	#define FAT_AU_SEARCH_UNITS		32
+#endif
+
 
 /* Master boot record structure */
 typedef struct
@@ -164,6 +245,17 @@ typedef struct
 
 
 
+/*
+* Clusters reserved for one file so concurrent writers do not
+* interleave their chains. The reservation is not recorded in the FAT.
+*/
+typedef struct fat_window_t
+{
+	uint32_t next;				// Next reserved cluster
+	uint32_t end;				// One past the last reserved cluster
+} fat_window;
+
+
 /*
 * FAT file handle for a directory or a file
 * Used for fopen/fseek/fread implementation
@@ -174,12 +266,18 @@ typedef struct fat_handle_t
 	uint8_t is_dir;			// Directory flag
 	uint8_t flags;				// Flags to indicate possible operations
 	
-	char filename[255];		// Filename (LFN)
+	char filename[FAT_NAME_SIZE];	// Filename (LFN)
 	uint32_t cluster;			// Cluster where the file/dir entry is located
+	uint32_t entrysector;	// Sector holding the short name entry of the file
+	uint8_t entryindex;		// Index of the short name entry in that sector
 	
 	uint32_t datacluster;	// First data cluster
 	uint32_t filesize;		// File size, 0 for directories
+	uint32_t contiguous;		// Clusters in the chain if it is one contiguous run, 0 if fragmented
+	fat_window window;		// Clusters reserved for the file to grow into
 	uint32_t ptr;				// Byte pointer for fread/fwrite/fseek or readdir
+	uint32_t dircluster;		// Directory cluster holding the entry at ptr (readdir)
+	uint32_t dirstart;		// Byte offset of dircluster in the directory
 	
 	sdcard_t * sdcard;		// Pointer to sdcard structure
 } fat_handle;
@@ -195,6 +293,69 @@ typedef struct lfn_cache_t
 	uint8_t checksum;
 } lfn_cache;
 
+/*
+* Long filename matcher, compares a name with the long name entries
+* one entry at a time as they are read
+*/
+typedef struct lfn_match_t
+{
+	const char *filename;	// Name to look for
+	uint16_t length;			// Length of the name
+	uint8_t next;				// Next expected ordinal, 0 if no name is being matched
+	uint8_t checksum;			// Short name checksum of the entries
+	uint8_t matched;			// Every long name entry matched
+} lfn_match;
+
+/*
+* Long filename decoder, copies the long name entries into a buffer of
+* FAT_NAME_SIZE bytes one entry at a time as they are read
+*/
+typedef struct lfn_decode_t
+{
+	char *output;				// Buffer for the name
+	uint8_t next;				// Next expected ordinal, 0 if no name is being decoded
+	uint8_t checksum;			// Short name checksum of the entries
+	uint8_t decoded;			// Every long name entry was read
+} lfn_decode;
+
+/*
+* Directory entry returned by fat_readdir_plus()
+*/
+typedef struct fat_dirent_t
+{
+	char name[FAT_NAME_SIZE];	// Long name, or the short name as NAME.EXT
+	uint8_t attr;					// Attributes
+	uint32_t size;					// File size in bytes, 0 for directories
+	uint32_t cluster;				// First data cluster, 0 if none
+	uint16_t crttime;				// Creation time
+	uint16_t crtdate;				// Creation date
+	uint16_t wrttime;				// Last write time
+	uint16_t wrtdate;				// Last write date
+	uint16_t accdate;				// Last access date
+} fat_dirent;
+
+/*
+* Directory name index, maps the hash of a long name to the position
+* of its first directory entry (sector * 16 + entry)
+*/
+typedef struct fat_index_slot_t
+{
+	uint16_t hash;
+	uint16_t position;		// FAT_INDEX_EMPTY or FAT_INDEX_DELETED if unused
+} fat_index_slot;
+
+#define FAT_INDEX_EMPTY		0xFFFF
+#define FAT_INDEX_DELETED	0xFFFE
+
+typedef struct fat_dir_index_t
+{
+	struct fat_dir_index_t *next;		// Next most recently used index
+	uint32_t cluster;						// First cluster of the directory
+	uint16_t size;							// Number of slots, a power of two, 0 if not indexed
+	uint16_t filled;						// Slots not empty, including deleted
+	fat_index_slot slots[];
+} fat_dir_index;
+
 /*
 * Fat directory entry offset structure
 */
@@ -205,6 +366,18 @@ typedef struct fat_entry_t
 	uint8_t entry;
 } fat_entry;
 
+/*
+* Result of the directory scan done before creating a file
+*/
+typedef struct fat_dir_scan_t
+{
+	uint8_t exists;			// The long name is in use
+	fat_entry found;			// Short name entry of the existing name
+	uint8_t space;				// A free run was found, it may need the directory to be extended
+	fat_entry free;			// First entry of the free run
+	uint8_t tails[FAT_SFN_TAIL_WINDOW / 8];	// Short name tails 1 to FAT_SFN_TAIL_WINDOW in use
+} fat_dir_scan;
+
 
 /*
 * Function declarations
@@ -212,7 +385,10 @@ typedef struct fat_entry_t
 uint8_t read_mbr(sdcard_t *sdcard);
 uint8_t fat_read_bootsector(sdcard_t *sdcard);
 
+uint8_t fat_read_fsinfo(sdcard_t * sdcard);
 uint8_t fat_update_fsinfo(sdcard_t * sdcard);
+uint8_t fat_statfs(sdcard_t * sdcard, uint32_t *free_clusters, uint32_t *used_clusters);
+uint8_t fat_free_bytes(sdcard_t * sdcard, uint64_t *bytes);
 uint8_t fat_print_cluster_stats(sdcard_t * sdcard);
 
 uint8_t fat_read_sector(sdcard_t *sdcard, uint32_t cluster, uint32_t sector);
@@ -224,19 +400,35 @@ uint32_t fat_get_next_cluster(sdcard_t *sdcard, uint32_t cluster);
 uint8_t fat_set_next_cluster(sdcard_t *sdcard, uint32_t cluster, uint32_t nextcluster);
 uint32_t fat_get_next_free_cluster(sdcard_t *sdcard, uint32_t cluster);
 uint32_t fat_allocate_cluster(sdcard_t *sdcard, uint32_t cluster);
+uint8_t fat_allocate_clusters(sdcard_t *sdcard, uint32_t lastcluster, uint32_t count, uint32_t *first);
+uint8_t fat_allocate_contiguous(sdcard_t *sdcard, uint32_t lastcluster, uint32_t count, uint32_t *first);
+uint8_t fat_idle_work(sdcard_t *sdcard, uint8_t budget);
+void fat_release_window(sdcard_t *sdcard, fat_window *window);
 
 dir_short_t * fat_find_lfn(sdcard_t *sdcard, uint32_t startcluster, const char * filename);
+void fat_dir_index_clear(sdcard_t *sdcard);
+void fat_dir_index_forget(sdcard_t *sdcard, uint32_t cluster);
+uint8_t fat_find_dir(sdcard_t *sdcard, uint32_t startcluster, const char * dirname, uint32_t *cluster);
+void fat_dentry_clear(sdcard_t *sdcard);
+void fat_dentry_forget(sdcard_t *sdcard, uint32_t cluster);
 dir_short_t * fat_find_sfn(sdcard_t *sdcard, uint32_t startcluster, const char * filename);
 
-dir_short_t * fat_find_next_file(sdcard_t *sdcard, fat_handle *handle, lfn_cache *lfn);
+dir_short_t * fat_find_next_file(sdcard_t *sdcard, fat_handle *handle, lfn_decode *lfn);
+uint16_t fat_find_next_files(sdcard_t *sdcard, fat_handle *handle, fat_dirent *entries, uint16_t max);
+void fat_fill_dirent(fat_dirent *entry, dir_short_t *dir, lfn_decode *lfn);
 
-uint8_t fat_create_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename);
+uint8_t fat_create_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename, fat_entry *location);
+uint8_t fat_create_directory(sdcard_t *sdcard, uint32_t startcluster, const char * dirname, uint16_t entries);
+uint8_t fat_delete_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename);
+uint8_t fat_rename_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename, uint32_t newcluster, const char * newname);
 uint8_t fat_truncate_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename);
+uint8_t fat_preallocate_file(sdcard_t *sdcard, uint32_t startcluster, const char * filename, uint32_t bytes, uint32_t *firstcluster);
 
 fat_entry * fat_find_free_entry(sdcard_t *sdcard, uint32_t startcluster, uint8_t entries);
 
-uint32_t fat_read_file(sdcard_t * sdcard, uint32_t startcluster, const char * filename, void * buffer, uint32_t start, uint32_t bytes);
-uint32_t fat_write_file(sdcard_t * sdcard, uint32_t startcluster, const char * filename, void * buffer, uint32_t start, uint32_t bytes);
+uint32_t fat_get_contiguous_clusters(sdcard_t *sdcard, uint32_t cluster);
+uint32_t fat_read_file(sdcard_t * sdcard, fat_handle *handle, void * buffer, uint32_t start, uint32_t bytes);
+uint32_t fat_write_file(sdcard_t * sdcard, fat_handle *handle, void * buffer, uint32_t start, uint32_t bytes);
 
 
 #endif
\ No newline at end of file
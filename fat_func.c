@@ -32,6 +32,44 @@
 
 
 
+/*******************************************************************
+* Find the directory holding the last part of a path
+* The path is split in one pass, the directories on the way are
+* looked up through the dentry cache.
+*
+* @param sdcard			SD Card structure
+* @param path				Path like /myfolder/subfolder/file.txt
+* @param name				Set to the last part of the path
+* @param size				Size of the name buffer
+* @param cluster			Set to the first cluster of the directory holding it
+*
+*/
+static uint8_t fat_walk_path(sdcard_t * sdcard, const char * path, char * name, uint16_t size, uint32_t * cluster)
+{
+	*cluster = sdcard->rootdir_begin_cluster;
+	
+	while(1)
+	{
+		// No name, or a part that is too long
+		if(next_path_part(&path, name, size) != 1)
+		{
+			return 0;
+		}
+		
+		// The last part
+		if(*path == 0x00)
+		{
+			return 1;
+		}
+		
+		if(!fat_find_dir(sdcard, *cluster, name, cluster))
+		{
+			return 0;
+		}
+	}
+}
+
+
 /*******************************************************************
 * fopen
 *
@@ -49,6 +87,8 @@ fat_handle * fat_fopen(sdcard_t * sdcard, const char * filename, const char * mo
 {
 	fat_handle *handle;
 	dir_short_t *dir;
+	fat_entry location;
+	uint32_t cluster;
 	
 	handle = malloc(sizeof(fat_handle));	
 	if(!handle)
@@ -60,11 +100,18 @@ fat_handle * fat_fopen(sdcard_t * sdcard, const char * filename, const char * mo
 	handle->is_file = 1;
 	handle->is_dir = 0;
 	handle->flags = 0;
-	memset(handle->filename, 0x00, 255);
+	memset(handle->filename, 0x00, sizeof(handle->filename));
 	handle->cluster = 0;
+	handle->entrysector = 0;
+	handle->entryindex = 0;
 	handle->filesize = 0;
 	handle->ptr = 0;
 	handle->datacluster = 0;
+	handle->contiguous = 0;
+	handle->window.next = 0;
+	handle->window.end = 0;
+	handle->dircluster = 0;
+	handle->dirstart = 0;
 	handle->sdcard = sdcard;
 	
 	//
@@ -96,11 +143,15 @@ fat_handle * fat_fopen(sdcard_t * sdcard, const char * filename, const char * mo
 	}
 	
 	//
-	// Parse path and look for the file/dir in the correct (sub)directory
-	// At the moment only the root directory is supported
+	// Parse path and look for the file in the correct (sub)directory
 	//
-	handle->cluster = sdcard->rootdir_begin_cluster;
-	strcpy(handle->filename, filename);
+	if(!fat_walk_path(sdcard, filename, handle->filename, sizeof(handle->filename), &cluster))
+	{
+		free(handle);
+		return NULL;
+	}
+	
+	handle->cluster = cluster;
 	
 	
 	// Check for existing file
@@ -112,19 +163,20 @@ fat_handle * fat_fopen(sdcard_t * sdcard, const char * filename, const char * mo
 		// Create the file
 		if(handle->flags & FILE_CREATE)
 		{
-			if(!fat_create_file(sdcard, handle->cluster, handle->filename))
+			if(!fat_create_file(sdcard, handle->cluster, handle->filename, &location))
 			{
 				free(handle);
 				return NULL;
 			}
 			
-			// Re-search for the file
-			dir = fat_find_lfn(sdcard, handle->cluster, handle->filename);
-			if(dir == NULL)
+			// Load the new entry
+			if(!fat_read_sector(sdcard, location.cluster, location.sector))
 			{
 				free(handle);
 				return NULL;
 			}
+			
+			dir = (dir_short_t *)(sdcard->buffer + (location.entry * 32));
 		}
 		// Do not create file
 		else
@@ -133,9 +185,11 @@ fat_handle * fat_fopen(sdcard_t * sdcard, const char * filename, const char * mo
 			return NULL;
 		}
 	}
-	// File exists
-	else
+	// Directories can not be opened as files
+	else if(dir->DIR_Attr & ATTR_DIRECTORY)
 	{
+		free(handle);
+		return NULL;
 	}
 	
 	// Truncate the file to zero length
@@ -156,11 +210,18 @@ fat_handle * fat_fopen(sdcard_t * sdcard, const char * filename, const char * mo
 		}
 	}
 
-	// Set data
+	// Set data, the entry is in the sector buffer so its location
+	// can be kept for updating the size in place
+	handle->entrysector = sdcard->loaded_sector;
+	handle->entryindex = (((char *)dir - sdcard->buffer) >> 5);
 	handle->datacluster = (((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO);
 	handle->filesize = dir->DIR_FileSize;
 	handle->ptr = 0;
 	
+	// Walk the chain once, contiguous files are read and written
+	// without FAT lookups
+	handle->contiguous = fat_get_contiguous_clusters(sdcard, handle->datacluster);
+	
 	
 	// Put the pointer to the end of the file, fseek can not be used
 	if(handle->flags & FILE_APPEND)
@@ -242,10 +303,44 @@ int32_t fat_ftell(fat_handle *handle)
 */
 int8_t fat_fclose(fat_handle *handle)
 {
+	// Write back the free cluster count and allocation hint
+	if(handle->flags & FILE_WRITE)
+	{
+		fat_release_window(handle->sdcard, &handle->window);
+		fat_update_fsinfo(handle->sdcard);
+	}
+	
 	free(handle);
 	return 1;
 }
 
+/*******************************************************************
+* fallocate
+* Reserve a contiguous cluster run large enough for the file to grow
+* to "bytes", the file size is not changed. Writes within the reserved
+* space do not need to allocate clusters.
+*/
+int8_t fat_fallocate(fat_handle *handle, uint32_t bytes)
+{
+	uint32_t cluster;
+	
+	// No write access
+	if(!(handle->flags & FILE_WRITE))
+	{
+		return 0;
+	}
+	
+	if(!fat_preallocate_file(handle->sdcard, handle->cluster, handle->filename, bytes, &cluster))
+	{
+		return 0;
+	}
+	
+	handle->datacluster = cluster;
+	handle->contiguous = fat_get_contiguous_clusters(handle->sdcard, cluster);
+	
+	return 1;
+}
+
 /*******************************************************************
 * fread
 */
@@ -272,7 +367,7 @@ uint32_t fat_fread(void * buffer, uint32_t size, uint32_t count, fat_handle *han
 		return 0;
 	
 	// Read the file data
-	bytesread = fat_read_file(handle->sdcard, handle->cluster, handle->filename, buffer, handle->ptr, bytes);
+	bytesread = fat_read_file(handle->sdcard, handle, buffer, handle->ptr, bytes);
 	
 	handle->ptr += bytesread;
 	
@@ -305,7 +400,7 @@ uint32_t fat_fwrite(void * buffer, uint32_t size, uint32_t count, fat_handle *ha
 		return 0;
 	
 	// Read the file data
-	byteswritten = fat_write_file(handle->sdcard, handle->cluster, handle->filename, buffer, handle->ptr, bytes);
+	byteswritten = fat_write_file(handle->sdcard, handle, buffer, handle->ptr, bytes);
 	
 	handle->ptr += byteswritten;
 	
@@ -321,8 +416,8 @@ uint32_t fat_fwrite(void * buffer, uint32_t size, uint32_t count, fat_handle *ha
 fat_handle * fat_opendir(sdcard_t * sdcard, const char * path)
 {
 	fat_handle *handle;
-	dir_short_t *dir;
-	char dirname[64];
+	uint32_t cluster;
+	int8_t part;
 	
 	handle = malloc(sizeof(fat_handle));	
 	if(!handle)
@@ -334,72 +429,160 @@ fat_handle * fat_opendir(sdcard_t * sdcard, const char * path)
 	handle->is_file = 0;
 	handle->is_dir = 1;
 	handle->flags = 0;
-	memset(handle->filename, 0x00, 255);
+	memset(handle->filename, 0x00, sizeof(handle->filename));
 	handle->cluster = 0;
+	handle->entrysector = 0;
+	handle->entryindex = 0;
 	handle->datacluster = 0;
 	handle->filesize = 0;
+	handle->contiguous = 0;
+	handle->window.next = 0;
+	handle->window.end = 0;
 	handle->ptr = 0;
+	handle->dircluster = 0;
+	handle->dirstart = 0;
 	handle->sdcard = sdcard;
 	
 
 	// The supplied path is the root directory
-	if(!get_path_part(path, dirname, 1))
-	{
-		strcpy(handle->filename, path);
-		handle->cluster = sdcard->rootdir_begin_cluster;
-		handle->datacluster = sdcard->rootdir_begin_cluster;
-		return handle;
-	}
-	
-	// Search the path until we reach the last directory
-	uint8_t level = 1;
-	uint32_t cluster = sdcard->rootdir_begin_cluster;
+	handle->cluster = sdcard->rootdir_begin_cluster;
+	handle->datacluster = sdcard->rootdir_begin_cluster;
+	strcpy(handle->filename, "/");
 	
-	while(1)
+	// Walk the path once, directories used before come from the
+	// dentry cache without scanning their parents
+	while((part = next_path_part(&path, handle->filename, sizeof(handle->filename))) == 1)
 	{
-		if(get_path_part(path, dirname, level))
-		{
-			// Check if directory exists
-			dir = fat_find_lfn(sdcard, cluster, dirname);
-			if(dir == NULL)
-			{
-				free(handle);
-				return NULL;
-			}
-			
-			// Is this a directory?
-			if(!(dir->DIR_Attr & ATTR_DIRECTORY))
-			{
-				free(handle);
-				return NULL;
-			}
-			
-			// This is the last directory
-			if(!get_path_part(path, dirname, level+1))
-			{
-				printf("%s found at %ld\n", dirname, cluster);
-				
-				// Set data
-				strcpy(handle->filename, dirname);
-				handle->cluster = cluster;
-				handle->datacluster = (((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO);
-				return handle;
-			}
-			
-			// Set parent cluster to the current directory
-			cluster = (((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO);
-		}
-		else
+		handle->cluster = handle->datacluster;
+		
+		if(!fat_find_dir(sdcard, handle->cluster, handle->filename, &cluster))
 		{
-			break;
+			free(handle);
+			return NULL;
 		}
 		
-		level++;
+		handle->datacluster = cluster;
 	}
+	
+	// Name too long
+	if(part < 0)
+	{
+		free(handle);
+		return NULL;
+	}
+	
+	// readdir starts at the first cluster
+	handle->dircluster = handle->datacluster;
+	
+	return handle;
+}
 
-	return NULL;	
+/*******************************************************************
+* rewinddir
+* readdir starts over from the first entry, without reading the card
+*/
+int8_t fat_rewinddir(fat_handle *handle)
+{
+	if(!handle->is_dir)
+	{
+		return 0;
+	}
+	
+	handle->ptr = 0;
+	handle->dircluster = handle->datacluster;
+	handle->dirstart = 0;
+	
+	return 1;
+}
+
+/*******************************************************************
+* mkdir
+* Creates the last directory of the path, the directories before it
+* must exist. Room for "entries" directory entries is allocated and
+* cleared up front.
+*/
+int8_t fat_mkdir(sdcard_t * sdcard, const char * path, uint16_t entries)
+{
+	char *dirname;
+	uint32_t cluster;
+	int8_t result = 0;
+	
+	dirname = malloc(FAT_NAME_SIZE);
+	if(!dirname)
+	{
+		return 0;
+	}
+	
+	if(fat_walk_path(sdcard, path, dirname, FAT_NAME_SIZE, &cluster))
+	{
+		result = fat_create_directory(sdcard, cluster, dirname, entries);
+	}
+	
+	free(dirname);
+	return result;
+}
+
+
+/*******************************************************************
+* unlink
+* Deletes a file or an empty directory, the data of the file is not
+* touched. Open handles of the file must be closed first.
+*/
+int8_t fat_unlink(sdcard_t * sdcard, const char * path)
+{
+	char *filename;
+	uint32_t cluster;
+	int8_t result = 0;
+	
+	filename = malloc(FAT_NAME_SIZE);
+	if(!filename)
+	{
+		return 0;
+	}
+	
+	if(fat_walk_path(sdcard, path, filename, FAT_NAME_SIZE, &cluster))
+	{
+		result = fat_delete_file(sdcard, cluster, filename);
+	}
+	
+	free(filename);
+	return result;
 }
 
+
+/*******************************************************************
+* rename
+* Renames a file or directory, or moves it to another directory. The
+* new path must not exist. Open handles of the file must be closed
+* first.
+*/
+int8_t fat_rename(sdcard_t * sdcard, const char * oldpath, const char * newpath)
+{
+	char *filename;
+	char *newname;
+	uint32_t cluster;
+	uint32_t newcluster;
+	int8_t result = 0;
+	
+	filename = malloc(FAT_NAME_SIZE * 2);
+	if(!filename)
+	{
+		return 0;
+	}
+	
+	newname = filename + FAT_NAME_SIZE;
+	
+	if(fat_walk_path(sdcard, oldpath, filename, FAT_NAME_SIZE, &cluster) &&
+		fat_walk_path(sdcard, newpath, newname, FAT_NAME_SIZE, &newcluster))
+	{
+		result = fat_rename_file(sdcard, cluster, filename, newcluster, newname);
+	}
+	
+	free(filename);
+	return result;
+}
+
+
 /*******************************************************************
 * closedir
 */
@@ -411,36 +594,82 @@ int8_t fat_closedir(fat_handle *handle)
 
 /*******************************************************************
 * readdir
+* The filename buffer must hold FAT_NAME_SIZE bytes
 */
 int8_t fat_readdir(fat_handle *handle, char *filename)
 {
 	dir_short_t *dir;
-	lfn_cache *lfn = malloc(sizeof(lfn_cache));
+	lfn_decode lfn;
 	
 	// Valid handle
 	if(!handle->is_dir)
 	{
-		free(lfn);
 		return 0;
 	}
 	
-	dir = fat_find_next_file(handle->sdcard, handle, lfn);
+	// The long name is decoded straight into the filename
+	lfn_decode_start(&lfn, filename);
+	
+	dir = fat_find_next_file(handle->sdcard, handle, &lfn);
 	if(dir == NULL)
 	{
-		free(lfn);
 		return 0;
 	}
 	
-	// Copy long or shortname
-	if(lfn_cache_get(lfn, filename))
-	{
-	}
-	else
+	// Copy shortname if there is no long name
+	if(!lfn_decode_sfn(&lfn, dir))
 	{
 		strncpy(filename, (const char *)dir->DIR_Name, 11);
 		filename[11] = 0x00;
 	}
 	
-	free(lfn);
 	return 1;
 }
+
+
+/*******************************************************************
+* readdir with everything the directory entry holds, so listing a
+* directory with sizes does not need a fopen per file. Nothing is
+* allocated, the long name is decoded straight into entry->name.
+*/
+int8_t fat_readdir_plus(fat_handle *handle, fat_dirent *entry)
+{
+	dir_short_t *dir;
+	lfn_decode lfn;
+	
+	// Valid handle
+	if(!handle->is_dir)
+	{
+		return 0;
+	}
+	
+	lfn_decode_start(&lfn, entry->name);
+	
+	dir = fat_find_next_file(handle->sdcard, handle, &lfn);
+	if(dir == NULL)
+	{
+		return 0;
+	}
+	
+	fat_fill_dirent(entry, dir, &lfn);
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* readdir for up to "max" entries at a time
+* All entries in a loaded directory sector are decoded before the next
+* sector is read. Returns the number of entries filled, 0 at the end
+* of the directory.
+*/
+uint16_t fat_readdir_batch(fat_handle *handle, fat_dirent *entries, uint16_t max)
+{
+	// Valid handle
+	if(!handle->is_dir)
+	{
+		return 0;
+	}
+	
+	return fat_find_next_files(handle->sdcard, handle, entries, max);
+}
@@ -50,13 +50,20 @@ fat_handle * fat_fopen(sdcard_t * sdcard, const char * filename, const char * mo
 int8_t fat_fseek(fat_handle *handle, int32_t offset, int8_t origin);
 int32_t fat_ftell(fat_handle *handle);
 int8_t fat_fclose(fat_handle *handle);
+int8_t fat_fallocate(fat_handle *handle, uint32_t bytes);
 
 uint32_t fat_fread(void * buffer, uint32_t size, uint32_t count, fat_handle *handle);
 uint32_t fat_fwrite(void * buffer, uint32_t size, uint32_t count, fat_handle *handle);
 
 
 fat_handle * fat_opendir(sdcard_t * sdcard, const char * path);
+int8_t fat_mkdir(sdcard_t * sdcard, const char * path, uint16_t entries);
+int8_t fat_unlink(sdcard_t * sdcard, const char * path);
+int8_t fat_rename(sdcard_t * sdcard, const char * oldpath, const char * newpath);
 int8_t fat_closedir(fat_handle *handle);
+int8_t fat_rewinddir(fat_handle *handle);
 int8_t fat_readdir(fat_handle *handle, char *filename);
+int8_t fat_readdir_plus(fat_handle *handle, fat_dirent *entry);
+uint16_t fat_readdir_batch(fat_handle *handle, fat_dirent *entries, uint16_t max);
 
 #endif
\ No newline at end of file
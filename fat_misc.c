@@ -104,30 +104,208 @@ uint8_t lfn_cache_get(lfn_cache *cache, char *output)
 }
 
 /*******************************************************************
-* Compare a filename with the cached LFN
+* Start matching long name entries against a filename
 */
-uint8_t lfn_cache_compare(lfn_cache *cache, const char *filename)
+void lfn_match_start(lfn_match *match, const char *filename)
 {
+	match->filename = filename;
+	match->length = strlen(filename);
+	
+	lfn_match_reset(match);
+}
+
+
+/*******************************************************************
+* Forget the long name entries seen so far
+*/
+void lfn_match_reset(lfn_match *match)
+{
+	match->next = 0;
+	match->checksum = 0;
+	match->matched = 0;
+}
+
+
+/*******************************************************************
+* Compare one long name entry with the filename
+* The entries are stored last part first. The first entry gives the
+* number of parts, names of another length are rejected before any
+* character is compared. Returns 1 while the entries seen so far match.
+*/
+uint8_t lfn_match_add(lfn_match *match, dir_short_t *dir)
+{
+	dir_long_t *ldir;
+	uint8_t ord;
 	uint8_t i;
-	uint8_t len;
-	char lfn[255];
+	uint16_t offset;
+	char c;
 	
-	if(!cache->strings) return 0;
-	if(!lfn_cache_get(cache, lfn)) return 0;
+	static const uint8_t chars[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
 	
-	len = strlen(filename);
+	ldir = (dir_long_t *)dir;
+	ord = (ldir->LDIR_Ord & 0x1F);
 	
-	for(i=0; i<len; i++)
+	// First entry of a name, holding the last part
+	if(ldir->LDIR_Ord & ATTR_LAST_LONG)
 	{
-		if(lfn[i] != filename[i])
+		match->matched = 0;
+		
+		// Wrong length
+		if(ord == 0 || match->length > (ord * 13) || match->length <= ((ord - 1) * 13))
 		{
+			match->next = 0;
 			return 0;
 		}
+		
+		match->next = ord;
+		match->checksum = ldir->LDIR_Chksum;
 	}
 	
+	// Out of order, or an earlier part did not match
+	if(match->next == 0 || ord != match->next || ldir->LDIR_Chksum != match->checksum)
+	{
+		match->next = 0;
+		match->matched = 0;
+		return 0;
+	}
+	
+	offset = (ord - 1) * 13;
+	
+	for(i = 0; i < 13; i++, offset++)
+	{
+		c = ((uint8_t *)ldir)[chars[i]];
+		
+		// Characters after the terminator are padding
+		if(offset > match->length)
+		{
+			break;
+		}
+		
+		if(c != (offset == match->length ? 0x00 : match->filename[offset]))
+		{
+			match->next = 0;
+			return 0;
+		}
+	}
+	
+	match->next--;
+	match->matched = (match->next == 0);
+	
 	return 1;
 }
 
+
+/*******************************************************************
+* Check if the long name entries before a short name entry matched
+* the filename, and that they belong to this short name
+*/
+uint8_t lfn_match_sfn(lfn_match *match, dir_short_t *dir)
+{
+	uint8_t matched;
+	
+	matched = (match->matched && match->checksum == sfn_checksum((char *)dir->DIR_Name));
+	
+	lfn_match_reset(match);
+	
+	return matched;
+}
+
+/*******************************************************************
+* Start decoding long names into a buffer of FAT_NAME_SIZE bytes
+*/
+void lfn_decode_start(lfn_decode *decode, char *output)
+{
+	decode->output = output;
+	
+	lfn_decode_reset(decode);
+}
+
+
+/*******************************************************************
+* Forget the long name entries seen so far
+*/
+void lfn_decode_reset(lfn_decode *decode)
+{
+	decode->next = 0;
+	decode->checksum = 0;
+	decode->decoded = 0;
+	decode->output[0] = 0x00;
+}
+
+
+/*******************************************************************
+* Copy the characters of one long name entry into the output
+* The entries are stored last part first, so each part is written
+* at its own offset and the terminator is placed by the first entry.
+* Returns 1 while the entries seen so far form one name.
+*/
+uint8_t lfn_decode_add(lfn_decode *decode, dir_short_t *dir)
+{
+	dir_long_t *ldir;
+	uint8_t ord;
+	uint8_t i;
+	uint16_t offset;
+	
+	static const uint8_t chars[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	
+	ldir = (dir_long_t *)dir;
+	ord = (ldir->LDIR_Ord & 0x1F);
+	
+	// First entry of a name, holding the last part
+	if(ldir->LDIR_Ord & ATTR_LAST_LONG)
+	{
+		decode->next = ord;
+		decode->checksum = ldir->LDIR_Chksum;
+		decode->decoded = 0;
+		
+		offset = ord * 13;
+		decode->output[offset < FAT_NAME_SIZE ? offset : (FAT_NAME_SIZE - 1)] = 0x00;
+	}
+	
+	// Out of order or not part of the same name
+	if(ord == 0 || ord != decode->next || ldir->LDIR_Chksum != decode->checksum)
+	{
+		lfn_decode_reset(decode);
+		return 0;
+	}
+	
+	offset = (ord - 1) * 13;
+	
+	// Characters after the terminator are padding and are not read
+	for(i = 0; i < 13 && offset < (FAT_NAME_SIZE - 1); i++, offset++)
+	{
+		decode->output[offset] = ((uint8_t *)ldir)[chars[i]];
+	}
+	
+	decode->next--;
+	decode->decoded = (decode->next == 0);
+	
+	return 1;
+}
+
+
+/*******************************************************************
+* Check if the long name decoded before a short name entry belongs to
+* it. Returns 0 when the entry only has a short name, the output is
+* then cleared.
+*/
+uint8_t lfn_decode_sfn(lfn_decode *decode, dir_short_t *dir)
+{
+	uint8_t decoded;
+	
+	decoded = (decode->decoded && decode->checksum == sfn_checksum((char *)dir->DIR_Name));
+	
+	if(!decoded)
+	{
+		lfn_decode_reset(decode);
+	}
+	
+	decode->next = 0;
+	decode->decoded = 0;
+	
+	return decoded;
+}
+
 /*******************************************************************
 * Build a LFN cache from a filename string
 */
@@ -284,6 +462,48 @@ uint8_t lfn_to_sfn(const char *lfn, char *sfn, uint16_t tailnum)
 
 
 
+/*******************************************************************
+* Format the short name of an entry as NAME.EXT, lower case when the
+* entry asks for it (DIR_NTRes bits 3 and 4)
+*/
+void sfn_to_string(dir_short_t *dir, char *output)
+{
+	uint8_t i;
+	uint8_t c;
+	uint8_t len = 0;
+	
+	for(i = 0; i < 11; i++)
+	{
+		c = dir->DIR_Name[i];
+		
+		if(c == ' ')
+		{
+			continue;
+		}
+		
+		// 0xE5 is stored as 0x05 in the first character
+		if(i == 0 && c == 0x05)
+		{
+			c = 0xE5;
+		}
+		
+		if(i == 8)
+		{
+			output[len++] = '.';
+		}
+		
+		if(c >= 'A' && c <= 'Z' && (dir->DIR_NTRes & (i < 8 ? 0x08 : 0x10)))
+		{
+			c += ('a' - 'A');
+		}
+		
+		output[len++] = c;
+	}
+	
+	output[len] = 0x00;
+}
+
+
 /*******************************************************************
 * Get part of a path like /myfolder/subfolder/file.txt
 * Leading slash is assumed if it is omitted, so all paths
@@ -337,6 +557,50 @@ uint8_t get_path_part(const char * path, char * output, uint8_t part)
 }
 
 
+/*******************************************************************
+* Copy the next part of a path like /myfolder/subfolder/file.txt and
+* move the path past it, so a path is split in one pass. Slashes
+* around the part are skipped, the path points at 0x00 after the
+* last part.
+* Returns 1 when a part was copied, 0 at the end of the path and -1
+* when the part does not fit in "size" bytes.
+*/
+int8_t next_path_part(const char ** path, char * output, uint16_t size)
+{
+	const char *p;
+	uint16_t i = 0;
+	
+	p = *path;
+	
+	while(*p == '/') { p++; }
+	
+	if(*p == 0x00)
+	{
+		*path = p;
+		return 0;
+	}
+	
+	while(*p != 0x00 && *p != '/')
+	{
+		if(i + 1 >= size)
+		{
+			return -1;
+		}
+		
+		output[i] = *p;
+		i++;
+		p++;
+	}
+	
+	output[i] = 0x00;
+	
+	while(*p == '/') { p++; }
+	
+	*path = p;
+	return 1;
+}
+
+
 /*******************************************************************
 * Determine if a directory entry is the last (every following entry is free)
 */
@@ -25,14 +25,25 @@
 uint8_t lfn_cache_reset(lfn_cache *cache);
 uint8_t lfn_cache_add(lfn_cache *cache, dir_short_t *dir);
 uint8_t lfn_cache_get(lfn_cache *cache, char *output);
-uint8_t lfn_cache_compare(lfn_cache *cache, const char *filename);
 uint8_t lfn_cache_from_string(lfn_cache *cache, const char *filename, uint8_t chksum);
 
+void lfn_match_start(lfn_match *match, const char *filename);
+void lfn_match_reset(lfn_match *match);
+uint8_t lfn_match_add(lfn_match *match, dir_short_t *dir);
+uint8_t lfn_match_sfn(lfn_match *match, dir_short_t *dir);
+
+void lfn_decode_start(lfn_decode *decode, char *output);
+void lfn_decode_reset(lfn_decode *decode);
+uint8_t lfn_decode_add(lfn_decode *decode, dir_short_t *dir);
+uint8_t lfn_decode_sfn(lfn_decode *decode, dir_short_t *dir);
+
 uint8_t sfn_checksum(char *shortname);
 uint8_t sfn_compare(const char *name1, const char *name2);
 uint8_t lfn_to_sfn(const char *lfn, char *sfn, uint16_t tailnum);
+void sfn_to_string(dir_short_t *dir, char *output);
 
 uint8_t get_path_part(const char * path, char * output, uint8_t part);
+int8_t next_path_part(const char ** path, char * output, uint16_t size);
 
 uint8_t fat_is_last_entry(dir_short_t *entry);
 uint8_t fat_is_free_entry(dir_short_t *entry);
@@ -22,12 +22,7 @@
 * Add usage examples
 * Remove/decrease debug-statements, the printf-strings waste a lot of memory
 * Disable external RAM and verify that it works with the 4kB RAM available in the mega128
-* Update Free_Count and Nxt_Free in the FSInfo structure on the partition, whenever necessary
 * Add more checks to make sure the SD card is inserted and inited before operations
-* Create folders support
-* Delete files and folders support
-* Rename files and folders support
-* fat_fopen: Support full paths, at the moment only files in the root directory are supported
 *
 * Changelog
 * ************************************************
@@ -46,6 +41,9 @@
 #include "fat_fs.h"
 #include "comms.h"
 
+// Current state of the leds, see comms.c
+volatile uint8_t led_status;
+
 /***************************************************************************************
 * Setup a stream for printf()
 */
@@ -84,6 +82,53 @@ void print_mem_usage(void)
 }
 
 
+#ifdef FAT_BENCHMARK
+/***************************************************************************************
+* Compare the cost of locating a FAT entry and a sector within a cluster,
+* using divides and using the shifts and masks from fat_read_bootsector().
+* Timer1 runs at the CPU clock, so the printed values are cycles per lookup.
+*/
+void benchmark_geometry(sdcard_t *sdcard)
+{
+	volatile uint32_t cluster = 123457;
+	volatile uint32_t filesector = 9876;
+	volatile uint32_t sector;
+	volatile uint32_t offset;
+	uint16_t start;
+	uint16_t divide;
+	uint16_t shift;
+	uint8_t i;
+	
+	TCCR1A = 0;
+	TCCR1B = (1 << CS10);
+	
+	start = TCNT1;
+	for(i = 0; i < 16; i++)
+	{
+		sector = ((cluster * 4) / sdcard->blocksize);
+		offset = ((cluster * 4) % sdcard->blocksize);
+		sector = (filesector / sdcard->sectors_per_cluster);
+		offset = (filesector - (sector * sdcard->sectors_per_cluster));
+	}
+	divide = TCNT1 - start;
+	
+	start = TCNT1;
+	for(i = 0; i < 16; i++)
+	{
+		sector = (cluster >> sdcard->entry_shift);
+		offset = ((cluster & sdcard->entry_mask) << 2);
+		sector = (filesector >> sdcard->cluster_shift);
+		offset = (filesector & sdcard->cluster_mask);
+	}
+	shift = TCNT1 - start;
+	
+	TCCR1B = 0;
+	
+	printf("Lookup cycles: divide %u, shift %u\n", (divide / 16), (shift / 16));
+}
+#endif
+
+
 /***************************************************************************************
 * Main
 */
@@ -216,6 +261,10 @@ int main(void)
 				
 				if(sdresponse)
 				{
+#ifdef FAT_BENCHMARK
+					benchmark_geometry(sdcard);
+#endif
+					
 					//
 					// Use fat_fopen/fat_fread/fat_fwrite and so on to handle files on the card
 					//
@@ -230,12 +279,21 @@ int main(void)
 			sdcard->init_attempted = 1;
 		}
 		
+		//
+		// Keep free clusters ready for the next writes
+		//
+		if(sdcard->inited && sdcard->fattype)
+		{
+			fat_idle_work(sdcard, 1);
+		}
+		
 		//
 		// The SD Card has previously been inserted, and is now removed
 		//
 		if(!sd_inserted() && sdcard->init_attempted)
 		{
 			printf("-- SD Card removed from slot --\n");
+			fat_dir_index_clear(sdcard);
 			sd_init_info(sdcard);
 		}
 		
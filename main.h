@@ -38,7 +38,7 @@
 #define CS_LCD		PB7
 
 
-volatile uint8_t led_status;
+extern volatile uint8_t led_status;
 
 void print_mem_usage(void);
 
@@ -60,6 +60,8 @@ uint8_t sd_write_protected(void)
 */
 void sd_init_info(sdcard_t *sdcard)
 {
+	uint8_t i;
+	
 	sdcard->inited = 0;
 	sdcard->init_attempted = 0;
 	sdcard->write_protected = 0;
@@ -68,6 +70,19 @@ void sd_init_info(sdcard_t *sdcard)
 	sdcard->fattype = 0;
 	sdcard->blocksize = 0;
 	sdcard->fsinfo_sector = 0;
+	sdcard->free_clusters = 0xFFFFFFFF;
+	sdcard->next_free_cluster = 2;
+	sdcard->fsinfo_dirty = 0;
+	sdcard->free_scan_sector = 0;
+	sdcard->free_scan_count = 0;
+	
+	sdcard->au_sectors = SD_AU_SECTORS;
+	sdcard->au_clusters = 0;
+	sdcard->au_first_cluster = 0;
+	
+	sdcard->free_ring_head = 0;
+	sdcard->free_ring_count = 0;
+	sdcard->free_ring_scan = 0;
 	
 	sdcard->partition_start = 0;
 	sdcard->partition_sectors = 0;
@@ -80,6 +95,19 @@ void sd_init_info(sdcard_t *sdcard)
 	sdcard->data_sectors = 0;
 	sdcard->data_clusters = 0;
 	sdcard->sectors_per_cluster = 0;
+	sdcard->sector_shift = 0;
+	sdcard->sector_mask = 0;
+	sdcard->cluster_shift = 0;
+	sdcard->cluster_mask = 0;
+	sdcard->entry_shift = 0;
+	sdcard->entry_mask = 0;
+	
+	sdcard->dir_index = NULL;
+	
+	for(i = 0; i < FAT_DENTRY_CACHE_SIZE; i++)
+	{
+		sdcard->dentry[i].length = 0;
+	}
 	
 	sdcard->loaded_sector = -1;
 }
@@ -224,6 +252,9 @@ uint8_t sd_init(sdcard_t *sdcard)
 		return 0;
 	}
 	
+	// Allocation unit size, the default is kept if this fails
+	sd_parse_ssr(sdcard);
+	
 	// Init succeeded
 	sdcard->inited = 1;
 	return 1;
@@ -438,6 +469,60 @@ uint8_t sd_parse_cid(sdcard_t *sdcard)
 }
 
 
+/*******************************************************************
+* Read the SD Status register (ACMD13) and get the allocation unit
+* size from it. sdcard->au_sectors is left unchanged if the card
+* does not report one.
+* @return uint8_t		1 on success, 0 on failure
+*
+* @param sdcard		SD card structure
+*/
+uint8_t sd_parse_ssr(sdcard_t *sdcard)
+{
+	uint8_t response;
+	uint8_t ausize;
+	
+	// AU_SIZE 4 bits, 16kB to 64MB in sectors
+	static const uint32_t au_table[16] = {
+		0, 32, 64, 128, 256, 512, 1024, 2048,
+		4096, 8192, 16384, 24576, 32768, 49152, 65536, 131072
+	};
+	
+	response = sd_send_cmd_r1(sdcard, APP_CMD, 0);
+	
+	// Get the data
+	sd_cs_low();
+	response = sd_send_cmd_raw(sdcard, SD_STATUS, 0);
+	
+	printf("[SSR] ");
+	
+	// Second byte of the R2 response
+	spi_byte(0xFF);
+	
+	if(response != 0x00 || sd_receive_datablock(sdcard, 64) != 0)
+	{
+		printf("Failed.\n");
+		sd_cs_high();
+		return 0;
+	}
+	
+	sd_cs_high();
+	
+	// AU_SIZE [431:428]
+	ausize = (sdcard->buffer[10] >> 4) & 0x0F;
+	
+	if(au_table[ausize] != 0)
+	{
+		sdcard->au_sectors = au_table[ausize];
+	}
+	
+	// Diagnostics
+	printf("AU size:       %lu sectors\n", sdcard->au_sectors);
+	
+	return 1;
+}
+
+
 /*******************************************************************
 * Send a command that only responds with one byte of data
 * and return the response (R1)
@@ -636,15 +721,16 @@ uint8_t sd_receive_datablock(sdcard_t *sdcard, uint16_t bytes)
 *
 * @param sdcard	SD card structure
 * @param bytes		Number of bytes to write
+* @param token		Start block token, 0xFE for single and 0xFC for multiple block writes
 */
-uint8_t sd_send_datablock(sdcard_t *sdcard, uint16_t bytes)
+uint8_t sd_send_datablock(sdcard_t *sdcard, uint16_t bytes, uint8_t token)
 {
 	uint16_t attempts = 0xFFFF;
 	uint8_t response;
 	uint16_t i = 0;
 	
 	// Send start block token
-	spi_byte(0xFE);
+	spi_byte(token);
 	
 	// Send the data
 	for(i=0; i < bytes; i++)
@@ -806,7 +892,7 @@ uint8_t sd_write_block(sdcard_t *sdcard, uint32_t blockaddr, uint8_t debug)
 		return 0;
 	}
 
-	response = sd_send_datablock(sdcard, sdcard->blocksize);
+	response = sd_send_datablock(sdcard, sdcard->blocksize, 0xFE);
 	if(response == 0xFF)
 	{
 		printf(" Write failed.\n");
@@ -838,3 +924,96 @@ uint8_t sd_write_block(sdcard_t *sdcard, uint32_t blockaddr, uint8_t debug)
 	return 1;
 }
 
+
+/*******************************************************************
+* Write sdcard->buffer to a number of consecutive blocks with one
+* WRITE_MULTIPLE_BLOCK command, used to clear clusters. The card can
+* program the blocks as one operation instead of one at a time.
+*
+* @param sdcard		SD card structure
+* @param blockaddr	The first block address to write
+* @param count		Number of blocks to write
+*/
+uint8_t sd_write_blocks(sdcard_t *sdcard, uint32_t blockaddr, uint32_t count)
+{
+	uint16_t attempts = 0xFFFF;
+	uint8_t response;
+	uint32_t i;
+	
+	if(count == 0)
+	{
+		return 1;
+	}
+	
+	if(count == 1)
+	{
+		return sd_write_block(sdcard, blockaddr, 0);
+	}
+	
+	led_on(3);
+	
+	printf("[WRITE BLOCKS] (%ld, %ld)", blockaddr, count);
+	
+	// Check if SD card is write protected
+	if(sdcard->write_protected)
+	{
+		printf(" Write protected\n");
+		led_off(3);
+		return 0;
+	}
+	
+	// Use byte addressing
+	if(sdcard->byteaddressing)
+	{
+		blockaddr = blockaddr * sdcard->blocksize;
+	}
+	
+	sd_cs_low();
+	
+	// Send write multiple blocks
+	response = sd_send_cmd_raw(sdcard, WRITE_MULTIPLE_BLOCK, blockaddr);
+	
+	if(response != 0x00)
+	{
+		printf(" Command failed.\n");
+		sd_cs_high();
+		
+		led_off(3);
+		return 0;
+	}
+	
+	for(i = 0; i < count; i++)
+	{
+		response = sd_send_datablock(sdcard, sdcard->blocksize, 0xFC);
+		if(response == 0xFF)
+		{
+			break;
+		}
+	}
+	
+	// Stop transmission token, then wait while the card is busy
+	spi_byte(0xFD);
+	spi_byte(0xFF);
+	
+	while(spi_byte(0xFF) == 0x00)
+	{
+		if(!attempts--)
+		{
+			response = 0xFF;
+			break;
+		}
+	}
+	
+	sd_cs_high();
+	
+	led_off(3);
+	
+	if(response == 0xFF)
+	{
+		printf(" Write failed.\n");
+		return 0;
+	}
+	
+	printf(" OK\n");
+	return 1;
+}
@@ -60,6 +60,7 @@
 
 #define APP_CMD					55	// R1 Defines to the card that the next com- mand is an application specific command rather than a standard command
 #define SD_SEND_OP_COND			41 // R1 Sends host capacity support ND information and activates the card's initialization process. 
+#define SD_STATUS					13 // R2 (ACMD13) Send the SD Status register, 64 bytes, in a data block
 
 #define READ_OCR					58 // R3 Reads the OCR register of a card. CCS bit is assigned to OCR[30].
 
@@ -74,6 +75,32 @@
 #define WRITE_SINGLE_BLOCK		24 // R1 Writes a block of the size selected by the SET_BLOCKLEN command.
 #define WRITE_MULTIPLE_BLOCK	25 // R1 Continuously writes blocks of data until ’Stop Tran’ token is sent (instead ’Start Block’).
 
+/* Allocation unit size in sectors, used when the card does not report one (4MB) */
+#ifndef SD_AU_SECTORS
+	#define SD_AU_SECTORS		8192
+#endif
+
+
+/* Free clusters kept in RAM for allocation, filled by fat_idle_work() */
+#ifndef FAT_FREE_RING_SIZE
+	#define FAT_FREE_RING_SIZE	16
+#endif
+
+/* Directories remembered by path lookups, see fat_find_dir() */
+#ifndef FAT_DENTRY_CACHE_SIZE
+	#define FAT_DENTRY_CACHE_SIZE	8
+#endif
+
+/* Directory found by a path lookup */
+typedef struct fat_dentry_t
+{
+	uint32_t parent;					// First cluster of the parent directory
+	uint32_t hash;						// Hash of the name
+	uint8_t length;					// Length of the name, 0 if the slot is unused
+	uint8_t attr;						// Attributes of the directory entry
+	uint32_t cluster;					// First cluster of the directory
+	uint32_t position;				// First entry of the name in the parent (sector * 16 + entry)
+} fat_dentry;
 
 /* SD Card structure */
 typedef struct
@@ -86,7 +113,21 @@ typedef struct
 	uint8_t fattype;					// 16 or 32
 	uint16_t blocksize;				// Block size, always 512 bytes
 	
-	uint32_t fsinfo_sector;			// Sector containing FSInfo structure
+	uint32_t fsinfo_sector;			// Sector containing FSInfo structure, 0 if there is none (FAT16)
+	uint32_t free_clusters;			// Free cluster count (FSInfo Free_Count), 0xFFFFFFFF if unknown
+	uint32_t next_free_cluster;	// Cluster to start looking for free clusters from (FSInfo Nxt_Free)
+	uint8_t fsinfo_dirty;			// Free count or hint changed since FSInfo was last written
+	uint32_t free_scan_sector;		// Next FAT sector to count while the free count is unknown
+	uint32_t free_scan_count;		// Free clusters found in the FAT sectors counted so far
+	
+	uint32_t au_sectors;				// Allocation unit size in sectors (SD Status AU_SIZE)
+	uint32_t au_clusters;			// Clusters per allocation unit, 0 if AUs are not used for allocation
+	uint32_t au_first_cluster;		// First cluster starting on an allocation unit boundary
+	
+	uint32_t free_ring[FAT_FREE_RING_SIZE];	// Free clusters in ascending order
+	uint8_t free_ring_head;			// First entry in free_ring
+	uint8_t free_ring_count;		// Number of entries in free_ring
+	uint32_t free_ring_scan;		// Next cluster for fat_idle_work() to check, 0 to restart
 	
 	uint32_t partition_start;		// Start of first partition
 	uint32_t partition_sectors;	// Sectors in first partition
@@ -103,6 +144,16 @@ typedef struct
 	  
 	uint8_t  sectors_per_cluster;	// Sectors per cluster
 	
+	uint8_t sector_shift;			// log2(blocksize)
+	uint16_t sector_mask;			// blocksize - 1
+	uint8_t cluster_shift;			// log2(sectors_per_cluster)
+	uint8_t cluster_mask;			// sectors_per_cluster - 1
+	uint8_t entry_shift;				// log2(FAT entries per sector)
+	uint16_t entry_mask;				// FAT entries per sector - 1
+	
+	struct fat_dir_index_t *dir_index;	// Name indexes of recently used directories (fat_fs.c)
+	fat_dentry dentry[FAT_DENTRY_CACHE_SIZE];	// Directories found by path lookups, most recent first
+	
 	int32_t loaded_sector;			// Sector currently loaded into buffer
 	char buffer[512];					// Sector sized buffer used for read/write operations
 } sdcard_t;
@@ -121,6 +172,7 @@ void sd_free_info(sdcard_t *sdcard);
 uint8_t sd_init(sdcard_t *sdcard);
 uint8_t sd_parse_csd(sdcard_t *sdcard);
 uint8_t sd_parse_cid(sdcard_t *sdcard);
+uint8_t sd_parse_ssr(sdcard_t *sdcard);
 
 uint8_t sd_send_cmd_r1(sdcard_t *sdcard, uint8_t cmd, uint32_t arg);
 uint16_t sd_send_cmd_r2(sdcard_t *sdcard, uint8_t cmd, uint32_t arg);
@@ -130,6 +182,7 @@ uint8_t sd_receive_datablock(sdcard_t *sdcard, uint16_t bytes);
 
 uint8_t sd_read_block(sdcard_t *sdcard, uint32_t blockaddr, uint8_t debug);
 uint8_t sd_write_block(sdcard_t *sdcard, uint32_t blockaddr, uint8_t debug);
+uint8_t sd_write_blocks(sdcard_t *sdcard, uint32_t blockaddr, uint32_t count);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1222 @@
+/***************************************************************************************
+* FAT16/32 filesystem implementation for AVR Microcontrollers
+* Copyright (C) 2013 Johnny Härtell
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Device: host
+*
+* Offline defragmenter for FAT16/32 card images
+*
+* Usage: defrag [-n] [-v] [-j threads] image
+*
+* Every fragmented file is moved to a free contiguous cluster run.
+* When no fragmented file fits into a free run, the free space is
+* compacted first: files are moved down into free runs below them,
+* highest files first, until the free space at the end of the volume
+* is large enough or nothing can be moved down any more. Directories
+* are never moved.
+* The volume is mounted with the FAT code of the library, the FAT is
+* then held in memory so the chains can be analysed and the data
+* copied by several threads at once.
+*
+* Each pass works in three steps so an interrupted run never leaves
+* a file pointing at unwritten data:
+* 1. The data of every file that fits a free run is copied there
+* 2. The new chains are written to all FATs, then the directory
+*    entries are pointed at them
+* 3. The old chains are released
+* Space freed by one pass is used by the next, until nothing moves.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "main.h"
+#include "sd.h"
+#include "fat_fs.h"
+#include "sd_image.h"
+
+// Largest single read or write while copying
+#define COPY_CHUNK		(1024 * 1024)
+
+
+/* A file found in the directory tree */
+typedef struct file_info_t
+{
+	off_t entry;				// Image offset of the short directory entry
+	char name[13];				// Short name, for messages
+	uint32_t firstcluster;	// First cluster of the chain
+	uint32_t clusters;		// Clusters in the chain, 0 if the chain is broken
+	uint32_t fragments;		// Contiguous runs in the chain
+	uint32_t target;			// First cluster of the new run, 0 if not moved
+} file_info;
+
+/* A run of free clusters */
+typedef struct free_run_t
+{
+	uint32_t start;
+	uint32_t length;
+} free_run;
+
+/* The volume being defragmented */
+typedef struct volume_t
+{
+	sdcard_t *sdcard;
+	int fd;
+
+	uint8_t numfats;				// FAT copies to keep up to date
+	uint32_t clustersize;		// Bytes per cluster
+	uint32_t lastcluster;		// Highest valid cluster number
+
+	uint8_t *fat;					// FAT #1 in memory
+	uint8_t *fatdirty;			// One flag per FAT sector
+
+	file_info *files;
+	uint32_t filecount;
+	uint32_t filealloc;
+
+	uint32_t *moves;				// Indexes of the files moved in this pass
+	uint32_t movecount;
+	uint32_t nextmove;			// Next move for a copy thread
+	uint8_t copyfailed;
+	pthread_mutex_t lock;
+} volume;
+
+
+/*******************************************************************
+* Get the FAT entry for a cluster, end of chain as 0xFFFFFFFF
+*/
+static uint32_t fat_get(volume *vol, uint32_t cluster)
+{
+	uint32_t value;
+
+	if(vol->sdcard->fattype == FAT16)
+	{
+		value = ((uint16_t *)vol->fat)[cluster];
+		return (value >= 0xFFF8 ? 0xFFFFFFFF : value);
+	}
+
+	value = ((uint32_t *)vol->fat)[cluster] & 0x0FFFFFFF;
+	return (value >= 0x0FFFFFF8 ? 0xFFFFFFFF : value);
+}
+
+/*******************************************************************
+* Set the FAT entry for a cluster and mark its sector for writing
+*/
+static void fat_set(volume *vol, uint32_t cluster, uint32_t value)
+{
+	uint32_t *fat32val;
+
+	if(vol->sdcard->fattype == FAT16)
+	{
+		((uint16_t *)vol->fat)[cluster] = (uint16_t)value;
+	}
+	else
+	{
+		// The upper four bits are reserved and must be preserved
+		fat32val = &((uint32_t *)vol->fat)[cluster];
+		*fat32val = (*fat32val & 0xF0000000) | (value & 0x0FFFFFFF);
+	}
+
+	vol->fatdirty[cluster >> vol->sdcard->entry_shift] = 1;
+}
+
+/*******************************************************************
+* Image offset of the first byte of a cluster
+*/
+static off_t cluster_offset(volume *vol, uint32_t cluster)
+{
+	return (off_t)fat_get_cluster_sector(vol->sdcard, cluster) * vol->sdcard->blocksize;
+}
+
+/*******************************************************************
+* Write the modified FAT sectors to every FAT copy
+*/
+static uint8_t write_fats(volume *vol)
+{
+	uint32_t sector;
+	uint8_t copy;
+	off_t offset;
+
+	for(sector = 0; sector < vol->sdcard->fat_sectors; sector++)
+	{
+		if(!vol->fatdirty[sector])
+		{
+			continue;
+		}
+
+		for(copy = 0; copy < vol->numfats; copy++)
+		{
+			offset = (off_t)(vol->sdcard->fat_begin_sector + copy * vol->sdcard->fat_sectors + sector) * vol->sdcard->blocksize;
+
+			if(pwrite(vol->fd, vol->fat + (size_t)sector * vol->sdcard->blocksize, vol->sdcard->blocksize, offset) != vol->sdcard->blocksize)
+			{
+				return 0;
+			}
+		}
+
+		vol->fatdirty[sector] = 0;
+	}
+
+	return (fsync(vol->fd) == 0);
+}
+
+/*******************************************************************
+* Mount the image and load FAT #1 into memory
+*/
+static uint8_t load_volume(volume *vol, const char *path, uint8_t writable)
+{
+	bootsector_t *bs;
+	size_t fatbytes;
+
+	vol->sdcard = malloc(sizeof(sdcard_t));
+	if(vol->sdcard == NULL)
+	{
+		return 0;
+	}
+
+	vol->fd = sd_image_open(vol->sdcard, path, writable);
+	if(vol->fd < 0)
+	{
+		perror(path);
+		return 0;
+	}
+
+	if(!read_mbr(vol->sdcard) || !fat_read_bootsector(vol->sdcard))
+	{
+		fprintf(stderr, "%s: no FAT16/32 volume found\n", path);
+		return 0;
+	}
+
+	// Number of FAT copies from the boot sector
+	if(!sd_read_block(vol->sdcard, vol->sdcard->partition_start, 0))
+	{
+		return 0;
+	}
+
+	bs = (bootsector_t *)vol->sdcard->buffer;
+	vol->numfats = bs->NumFATs;
+	vol->clustersize = (uint32_t)vol->sdcard->blocksize << vol->sdcard->cluster_shift;
+	vol->lastcluster = vol->sdcard->data_clusters + 1;
+
+	fatbytes = (size_t)vol->sdcard->fat_sectors * vol->sdcard->blocksize;
+	vol->fat = malloc(fatbytes);
+	vol->fatdirty = calloc(vol->sdcard->fat_sectors, 1);
+
+	if(vol->fat == NULL || vol->fatdirty == NULL)
+	{
+		return 0;
+	}
+
+	if(pread(vol->fd, vol->fat, fatbytes, (off_t)vol->sdcard->fat_begin_sector * vol->sdcard->blocksize) != (ssize_t)fatbytes)
+	{
+		fprintf(stderr, "%s: unable to read the FAT\n", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*******************************************************************
+* Add a file to the file list
+*/
+static uint8_t add_file(volume *vol, off_t entry, dir_short_t *dir)
+{
+	file_info *file;
+	uint8_t i, j;
+
+	if(vol->filecount == vol->filealloc)
+	{
+		vol->filealloc = (vol->filealloc ? vol->filealloc * 2 : 1024);
+		vol->files = realloc(vol->files, vol->filealloc * sizeof(file_info));
+
+		if(vol->files == NULL)
+		{
+			return 0;
+		}
+	}
+
+	file = &vol->files[vol->filecount++];
+	memset(file, 0x00, sizeof(file_info));
+
+	file->entry = entry;
+	file->firstcluster = ((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
+
+	// NAME.EXT without padding
+	for(i = 0, j = 0; i < 11; i++)
+	{
+		if(i == 8 && dir->DIR_Name[8] != ' ')
+		{
+			file->name[j++] = '.';
+		}
+
+		if(dir->DIR_Name[i] != ' ')
+		{
+			file->name[j++] = dir->DIR_Name[i];
+		}
+	}
+
+	return 1;
+}
+
+/*******************************************************************
+* Walk the directory tree and collect every file with data
+* Directories are visited breadth first, they are not moved.
+*/
+static uint8_t scan_directories(volume *vol)
+{
+	uint32_t *queue;
+	uint32_t queuehead = 0;
+	uint32_t queuecount = 0;
+	uint32_t queuealloc = 64;
+	uint32_t cluster;
+	uint32_t entries;
+	uint32_t i;
+	uint32_t walked;
+	uint8_t *data;
+	uint8_t done;
+	off_t offset;
+	size_t bytes;
+	dir_short_t *dir;
+
+	queue = malloc(queuealloc * sizeof(uint32_t));
+	data = malloc(vol->clustersize > vol->sdcard->rootdir_sectors * 512 ? vol->clustersize : vol->sdcard->rootdir_sectors * 512);
+
+	if(queue == NULL || data == NULL)
+	{
+		return 0;
+	}
+
+	// The root directory, cluster 0 on FAT16
+	queue[queuecount++] = vol->sdcard->rootdir_begin_cluster;
+
+	while(queuehead < queuecount)
+	{
+		cluster = queue[queuehead++];
+		done = 0;
+		walked = 0;
+
+		while(!done)
+		{
+			// FAT16 root directory area
+			if(cluster == 0)
+			{
+				offset = (off_t)vol->sdcard->rootdir_begin_sector * vol->sdcard->blocksize;
+				bytes = (size_t)vol->sdcard->rootdir_sectors * vol->sdcard->blocksize;
+			}
+			else
+			{
+				offset = cluster_offset(vol, cluster);
+				bytes = vol->clustersize;
+			}
+
+			if(pread(vol->fd, data, bytes, offset) != (ssize_t)bytes)
+			{
+				return 0;
+			}
+
+			entries = bytes / sizeof(dir_short_t);
+
+			for(i = 0; i < entries; i++)
+			{
+				dir = (dir_short_t *)(data + i * sizeof(dir_short_t));
+
+				// End of directory
+				if(dir->DIR_Name[0] == ENTRY_BLANK)
+				{
+					done = 1;
+					break;
+				}
+
+				if(dir->DIR_Name[0] == ENTRY_DELETED || dir->DIR_Name[0] == '.')
+				{
+					continue;
+				}
+
+				if((dir->DIR_Attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME || (dir->DIR_Attr & ATTR_VOLUME_ID))
+				{
+					continue;
+				}
+
+				// Subdirectory, visit it later
+				if(dir->DIR_Attr & ATTR_DIRECTORY)
+				{
+					if(queuecount == queuealloc)
+					{
+						queuealloc *= 2;
+						queue = realloc(queue, queuealloc * sizeof(uint32_t));
+
+						if(queue == NULL)
+						{
+							return 0;
+						}
+					}
+
+					queue[queuecount] = ((uint32_t)dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
+
+					if(queue[queuecount] >= 2 && queue[queuecount] <= vol->lastcluster)
+					{
+						queuecount++;
+					}
+
+					continue;
+				}
+
+				if(dir->DIR_FileSize == 0)
+				{
+					continue;
+				}
+
+				if(!add_file(vol, offset + i * sizeof(dir_short_t), dir))
+				{
+					return 0;
+				}
+			}
+
+			// Next cluster of the directory, with a guard against loops
+			if(cluster == 0 || ++walked > vol->lastcluster)
+			{
+				break;
+			}
+
+			cluster = fat_get(vol, cluster);
+
+			if(cluster < 2 || cluster > vol->lastcluster)
+			{
+				break;
+			}
+		}
+	}
+
+	free(data);
+	free(queue);
+
+	return 1;
+}
+
+
+/*******************************************************************
+* Measure the chains of a slice of the file list
+* Runs in several threads, the FAT is only read.
+*/
+typedef struct chain_job_t
+{
+	volume *vol;
+	uint32_t first;
+	uint32_t last;
+} chain_job;
+
+static void * measure_chains(void *arg)
+{
+	chain_job *job = (chain_job *)arg;
+	volume *vol = job->vol;
+	file_info *file;
+	uint32_t cluster;
+	uint32_t nextcluster;
+	uint32_t i;
+
+	for(i = job->first; i < job->last; i++)
+	{
+		file = &vol->files[i];
+		file->clusters = 0;
+		file->fragments = 0;
+		cluster = file->firstcluster;
+
+		while(cluster >= 2 && cluster <= vol->lastcluster)
+		{
+			file->clusters++;
+			nextcluster = fat_get(vol, cluster);
+
+			if(nextcluster == 0xFFFFFFFF)
+			{
+				break;
+			}
+
+			if(nextcluster != cluster + 1)
+			{
+				file->fragments++;
+			}
+
+			// Broken or looping chain, leave the file alone
+			if(nextcluster < 2 || nextcluster > vol->lastcluster || file->clusters > vol->lastcluster)
+			{
+				file->clusters = 0;
+				break;
+			}
+
+			cluster = nextcluster;
+		}
+
+		if(file->clusters > 0)
+		{
+			file->fragments++;
+		}
+	}
+
+	return NULL;
+}
+
+/*******************************************************************
+* Measure every chain using a number of threads
+*/
+static uint8_t measure_files(volume *vol, uint32_t threads)
+{
+	pthread_t *tid;
+	chain_job *jobs;
+	uint32_t slice;
+	uint32_t i;
+
+	tid = malloc(threads * sizeof(pthread_t));
+	jobs = malloc(threads * sizeof(chain_job));
+
+	if(tid == NULL || jobs == NULL)
+	{
+		return 0;
+	}
+
+	slice = (vol->filecount + threads - 1) / threads;
+
+	for(i = 0; i < threads; i++)
+	{
+		jobs[i].vol = vol;
+		jobs[i].first = (i * slice < vol->filecount ? i * slice : vol->filecount);
+		jobs[i].last = (jobs[i].first + slice < vol->filecount ? jobs[i].first + slice : vol->filecount);
+
+		if(pthread_create(&tid[i], NULL, measure_chains, &jobs[i]) != 0)
+		{
+			return 0;
+		}
+	}
+
+	for(i = 0; i < threads; i++)
+	{
+		pthread_join(tid[i], NULL);
+	}
+
+	free(jobs);
+	free(tid);
+
+	return 1;
+}
+
+
+/*******************************************************************
+* Sort helpers, free runs by length and files by chain length
+*/
+static int compare_runs(const void *a, const void *b)
+{
+	const free_run *ra = a;
+	const free_run *rb = b;
+
+	if(ra->length != rb->length)
+	{
+		return (ra->length < rb->length ? -1 : 1);
+	}
+
+	return (ra->start < rb->start ? -1 : (ra->start > rb->start));
+}
+
+static volume *sort_volume;
+
+static int compare_moves(const void *a, const void *b)
+{
+	const file_info *fa = &sort_volume->files[*(const uint32_t *)a];
+	const file_info *fb = &sort_volume->files[*(const uint32_t *)b];
+
+	return (fa->clusters > fb->clusters ? -1 : (fa->clusters < fb->clusters));
+}
+
+/*******************************************************************
+* Pick a free run for every fragmented file, largest files first.
+* The smallest run that fits is used. Runs are taken from the free
+* space as it was at the start of the pass, so the targets never
+* overlap a chain that is still in use.
+* Returns the number of files that will be moved.
+*/
+static uint32_t plan_moves(volume *vol)
+{
+	free_run *runs = NULL;
+	uint32_t runcount = 0;
+	uint32_t runalloc = 0;
+	uint32_t cluster;
+	uint32_t start;
+	uint32_t i;
+	uint32_t low, high, mid;
+	file_info *file;
+	free_run rest;
+
+	// Collect the free runs
+	for(cluster = 2; cluster <= vol->lastcluster; )
+	{
+		if(fat_get(vol, cluster) != 0)
+		{
+			cluster++;
+			continue;
+		}
+
+		start = cluster;
+		while(cluster <= vol->lastcluster && fat_get(vol, cluster) == 0)
+		{
+			cluster++;
+		}
+
+		if(runcount == runalloc)
+		{
+			runalloc = (runalloc ? runalloc * 2 : 1024);
+			runs = realloc(runs, runalloc * sizeof(free_run));
+
+			if(runs == NULL)
+			{
+				return 0;
+			}
+		}
+
+		runs[runcount].start = start;
+		runs[runcount].length = cluster - start;
+		runcount++;
+	}
+
+	qsort(runs, runcount, sizeof(free_run), compare_runs);
+
+	// Fragmented files, largest first
+	vol->movecount = 0;
+	for(i = 0; i < vol->filecount; i++)
+	{
+		vol->files[i].target = 0;
+
+		if(vol->files[i].clusters > 0 && vol->files[i].fragments > 1)
+		{
+			vol->moves[vol->movecount++] = i;
+		}
+	}
+
+	sort_volume = vol;
+	qsort(vol->moves, vol->movecount, sizeof(uint32_t), compare_moves);
+
+	for(i = 0; i < vol->movecount; i++)
+	{
+		file = &vol->files[vol->moves[i]];
+
+		// Smallest run that fits
+		low = 0;
+		high = runcount;
+		while(low < high)
+		{
+			mid = (low + high) / 2;
+
+			if(runs[mid].length < file->clusters)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+
+		if(low == runcount)
+		{
+			continue;
+		}
+
+		file->target = runs[low].start;
+
+		// Put the rest of the run back in order
+		rest.start = runs[low].start + file->clusters;
+		rest.length = runs[low].length - file->clusters;
+
+		memmove(&runs[low], &runs[low + 1], (runcount - low - 1) * sizeof(free_run));
+		runcount--;
+
+		if(rest.length > 0)
+		{
+			low = 0;
+			high = runcount;
+			while(low < high)
+			{
+				mid = (low + high) / 2;
+
+				if(compare_runs(&runs[mid], &rest) < 0)
+					low = mid + 1;
+				else
+					high = mid;
+			}
+
+			memmove(&runs[low + 1], &runs[low], (runcount - low) * sizeof(free_run));
+			runs[low] = rest;
+			runcount++;
+		}
+	}
+
+	free(runs);
+
+	// Keep only the files that got a target
+	for(i = 0, start = 0; i < vol->movecount; i++)
+	{
+		if(vol->files[vol->moves[i]].target != 0)
+		{
+			vol->moves[start++] = vol->moves[i];
+		}
+	}
+
+	vol->movecount = start;
+
+	return vol->movecount;
+}
+
+
+/*******************************************************************
+* Sort helper for compaction, files from the end of the volume down
+*/
+static int compare_positions(const void *a, const void *b)
+{
+	const file_info *fa = &sort_volume->files[*(const uint32_t *)a];
+	const file_info *fb = &sort_volume->files[*(const uint32_t *)b];
+
+	return (fa->firstcluster > fb->firstcluster ? -1 : (fa->firstcluster < fb->firstcluster));
+}
+
+/*******************************************************************
+* Maximum run length of each node of a segment tree over the runs
+*/
+static void update_run_tree(uint32_t *tree, uint32_t size, uint32_t index, uint32_t length)
+{
+	index += size;
+	tree[index] = length;
+
+	for(index /= 2; index > 0; index /= 2)
+	{
+		tree[index] = (tree[index * 2] > tree[index * 2 + 1] ? tree[index * 2] : tree[index * 2 + 1]);
+	}
+}
+
+/*******************************************************************
+* Plan moves that compact the used space towards the start of the
+* volume. Every file, highest first, is moved to the lowest free run
+* that holds it, if that run lies before the file. Moved files leave
+* their clusters free, so the free space collects at the end over
+* the passes. Every move lowers the first cluster of a file, so the
+* passes end.
+* Returns the number of files that will be moved.
+*/
+static uint32_t plan_compaction(volume *vol)
+{
+	free_run *runs = NULL;
+	uint32_t *tree;
+	uint32_t runcount = 0;
+	uint32_t runalloc = 0;
+	uint32_t size;
+	uint32_t cluster;
+	uint32_t start;
+	uint32_t node;
+	uint32_t i;
+	file_info *file;
+
+	// Collect the free runs
+	for(cluster = 2; cluster <= vol->lastcluster; )
+	{
+		if(fat_get(vol, cluster) != 0)
+		{
+			cluster++;
+			continue;
+		}
+
+		start = cluster;
+		while(cluster <= vol->lastcluster && fat_get(vol, cluster) == 0)
+		{
+			cluster++;
+		}
+
+		if(runcount == runalloc)
+		{
+			runalloc = (runalloc ? runalloc * 2 : 1024);
+			runs = realloc(runs, runalloc * sizeof(free_run));
+
+			if(runs == NULL)
+			{
+				return 0;
+			}
+		}
+
+		runs[runcount].start = start;
+		runs[runcount].length = cluster - start;
+		runcount++;
+	}
+
+	// The runs are in order, find the lowest one that fits with a
+	// segment tree of the longest run below each node
+	for(size = 1; size < runcount; size *= 2);
+
+	tree = calloc(size * 2, sizeof(uint32_t));
+	if(tree == NULL)
+	{
+		free(runs);
+		return 0;
+	}
+
+	for(i = 0; i < runcount; i++)
+	{
+		update_run_tree(tree, size, i, runs[i].length);
+	}
+
+	// Every file with an intact chain, highest first
+	vol->movecount = 0;
+	for(i = 0; i < vol->filecount; i++)
+	{
+		vol->files[i].target = 0;
+
+		if(vol->files[i].clusters > 0)
+		{
+			vol->moves[vol->movecount++] = i;
+		}
+	}
+
+	sort_volume = vol;
+	qsort(vol->moves, vol->movecount, sizeof(uint32_t), compare_positions);
+
+	for(i = 0; i < vol->movecount; i++)
+	{
+		file = &vol->files[vol->moves[i]];
+
+		if(runcount == 0 || tree[1] < file->clusters)
+		{
+			continue;
+		}
+
+		// Lowest run that holds the file
+		for(node = 1; node < size; )
+		{
+			node = (tree[node * 2] >= file->clusters ? node * 2 : node * 2 + 1);
+		}
+
+		node -= size;
+
+		if(runs[node].start >= file->firstcluster)
+		{
+			continue;
+		}
+
+		file->target = runs[node].start;
+		runs[node].start += file->clusters;
+		runs[node].length -= file->clusters;
+		update_run_tree(tree, size, node, runs[node].length);
+	}
+
+	free(tree);
+	free(runs);
+
+	// Keep only the files that got a target
+	for(i = 0, start = 0; i < vol->movecount; i++)
+	{
+		if(vol->files[vol->moves[i]].target != 0)
+		{
+			vol->moves[start++] = vol->moves[i];
+		}
+	}
+
+	vol->movecount = start;
+
+	return vol->movecount;
+}
+
+
+/*******************************************************************
+* Copy thread, takes moves from the shared list until it is empty
+* Sources are read one contiguous extent at a time.
+*/
+static void * copy_files(void *arg)
+{
+	volume *vol = (volume *)arg;
+	file_info *file;
+	uint8_t *buffer;
+	uint32_t move;
+	uint32_t cluster;
+	uint32_t extent;
+	uint32_t copied;
+	size_t bytes;
+	size_t chunk;
+	size_t done;
+	off_t source;
+	off_t target;
+
+	buffer = malloc(COPY_CHUNK);
+	if(buffer == NULL)
+	{
+		vol->copyfailed = 1;
+		return NULL;
+	}
+
+	while(1)
+	{
+		pthread_mutex_lock(&vol->lock);
+		move = vol->nextmove++;
+		pthread_mutex_unlock(&vol->lock);
+
+		if(move >= vol->movecount || vol->copyfailed)
+		{
+			break;
+		}
+
+		file = &vol->files[vol->moves[move]];
+		cluster = file->firstcluster;
+		copied = 0;
+
+		while(copied < file->clusters)
+		{
+			// Extent of consecutive source clusters
+			extent = 1;
+			while(copied + extent < file->clusters && fat_get(vol, cluster + extent - 1) == cluster + extent)
+			{
+				extent++;
+			}
+
+			source = cluster_offset(vol, cluster);
+			target = cluster_offset(vol, file->target + copied);
+			bytes = (size_t)extent * vol->clustersize;
+
+			for(done = 0; done < bytes; done += chunk)
+			{
+				chunk = (bytes - done < COPY_CHUNK ? bytes - done : COPY_CHUNK);
+
+				if(pread(vol->fd, buffer, chunk, source + done) != (ssize_t)chunk ||
+					pwrite(vol->fd, buffer, chunk, target + done) != (ssize_t)chunk)
+				{
+					vol->copyfailed = 1;
+					break;
+				}
+			}
+
+			copied += extent;
+			cluster = fat_get(vol, cluster + extent - 1);
+		}
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+/*******************************************************************
+* Point the directory entry of a file at a new first cluster
+*/
+static uint8_t update_entry(volume *vol, file_info *file, uint32_t cluster)
+{
+	dir_short_t dir;
+
+	if(pread(vol->fd, &dir, sizeof(dir), file->entry) != sizeof(dir))
+	{
+		return 0;
+	}
+
+	dir.DIR_FstClusHI = (cluster >> 16);
+	dir.DIR_FstClusLO = (cluster & 0xFFFF);
+
+	return (pwrite(vol->fd, &dir, sizeof(dir), file->entry) == sizeof(dir));
+}
+
+/*******************************************************************
+* Copy, relink and release the chains of the planned moves
+*/
+static uint8_t run_moves(volume *vol, uint32_t threads)
+{
+	pthread_t *tid;
+	file_info *file;
+	uint32_t cluster;
+	uint32_t nextcluster;
+	uint32_t i, j;
+
+	//
+	// 1. Copy the data
+	//
+	tid = malloc(threads * sizeof(pthread_t));
+	if(tid == NULL)
+	{
+		return 0;
+	}
+
+	vol->nextmove = 0;
+	vol->copyfailed = 0;
+
+	for(i = 0; i < threads; i++)
+	{
+		if(pthread_create(&tid[i], NULL, copy_files, vol) != 0)
+		{
+			return 0;
+		}
+	}
+
+	for(i = 0; i < threads; i++)
+	{
+		pthread_join(tid[i], NULL);
+	}
+
+	free(tid);
+
+	if(vol->copyfailed || fsync(vol->fd) != 0)
+	{
+		fprintf(stderr, "Copying failed, nothing was changed\n");
+		return 0;
+	}
+
+	//
+	// 2. Link the new chains, then switch the directory entries
+	//
+	for(i = 0; i < vol->movecount; i++)
+	{
+		file = &vol->files[vol->moves[i]];
+
+		for(j = 0; j < file->clusters; j++)
+		{
+			fat_set(vol, file->target + j, (j + 1 < file->clusters ? file->target + j + 1 : 0x0FFFFFFF));
+		}
+	}
+
+	if(!write_fats(vol))
+	{
+		return 0;
+	}
+
+	for(i = 0; i < vol->movecount; i++)
+	{
+		file = &vol->files[vol->moves[i]];
+
+		if(!update_entry(vol, file, file->target))
+		{
+			return 0;
+		}
+	}
+
+	if(fsync(vol->fd) != 0)
+	{
+		return 0;
+	}
+
+	//
+	// 3. Release the old chains
+	//
+	for(i = 0; i < vol->movecount; i++)
+	{
+		file = &vol->files[vol->moves[i]];
+		cluster = file->firstcluster;
+
+		for(j = 0; j < file->clusters; j++)
+		{
+			nextcluster = fat_get(vol, cluster);
+			fat_set(vol, cluster, 0);
+			cluster = nextcluster;
+		}
+
+		file->firstcluster = file->target;
+		file->fragments = 1;
+	}
+
+	return write_fats(vol);
+}
+
+
+/*******************************************************************
+* Store the free cluster count and the first free cluster in FSInfo
+*/
+static uint8_t refresh_fsinfo(volume *vol)
+{
+	uint32_t cluster;
+	uint32_t freecount = 0;
+	uint32_t firstfree = 0;
+
+	for(cluster = 2; cluster <= vol->lastcluster; cluster++)
+	{
+		if(fat_get(vol, cluster) == 0)
+		{
+			if(firstfree == 0)
+			{
+				firstfree = cluster;
+			}
+
+			freecount++;
+		}
+	}
+
+	vol->sdcard->free_clusters = freecount;
+	vol->sdcard->next_free_cluster = (firstfree ? firstfree : 2);
+	vol->sdcard->fsinfo_dirty = 1;
+
+	// The library buffer may hold a sector changed behind its back
+	vol->sdcard->loaded_sector = -1;
+
+	return fat_update_fsinfo(vol->sdcard);
+}
+
+
+/*******************************************************************
+* Count the files whose chain is in more than one run
+*/
+static uint32_t count_fragmented(volume *vol)
+{
+	uint32_t i;
+	uint32_t count = 0;
+
+	for(i = 0; i < vol->filecount; i++)
+	{
+		if(vol->files[i].clusters > 0 && vol->files[i].fragments > 1)
+		{
+			count++;
+		}
+	}
+
+	return count;
+}
+
+
+/*******************************************************************
+* Main
+*/
+int main(int argc, char **argv)
+{
+	volume vol;
+	uint32_t threads;
+	uint32_t fragmented;
+	uint32_t moved;
+	uint32_t pass;
+	uint8_t compacting;
+	uint32_t i;
+	uint8_t dryrun = 0;
+	uint8_t verbose = 0;
+	int opt;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while((opt = getopt(argc, argv, "nvj:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'n': dryrun = 1; break;
+			case 'v': verbose = 1; break;
+			case 'j': threads = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n] [-v] [-j threads] image\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		fprintf(stderr, "Usage: %s [-n] [-v] [-j threads] image\n", argv[0]);
+		return 2;
+	}
+
+	if(threads < 1)
+	{
+		threads = 1;
+	}
+
+	// The library prints its debug messages to stdout
+	if(!verbose && freopen("/dev/null", "w", stdout) == NULL)
+	{
+		perror("/dev/null");
+		return 1;
+	}
+
+	memset(&vol, 0x00, sizeof(vol));
+	pthread_mutex_init(&vol.lock, NULL);
+
+	if(!load_volume(&vol, argv[optind], !dryrun))
+	{
+		return 1;
+	}
+
+	if(!scan_directories(&vol))
+	{
+		fprintf(stderr, "Unable to read the directory tree\n");
+		return 1;
+	}
+
+	vol.moves = malloc((vol.filecount + 1) * sizeof(uint32_t));
+	if(vol.moves == NULL || !measure_files(&vol, threads))
+	{
+		return 1;
+	}
+
+	for(i = 0, fragmented = 0; i < vol.filecount; i++)
+	{
+		if(vol.files[i].fragments > 1)
+		{
+			fragmented++;
+		}
+
+		if(vol.files[i].clusters == 0)
+		{
+			fprintf(stderr, "%s: broken cluster chain, skipped\n", vol.files[i].name);
+		}
+	}
+
+	fprintf(stderr, "FAT%d, %u clusters of %u bytes, %u files, %u fragmented\n",
+		vol.sdcard->fattype, vol.sdcard->data_clusters, vol.clustersize, vol.filecount, fragmented);
+
+	moved = 0;
+
+	for(pass = 1; ; pass++)
+	{
+		compacting = 0;
+
+		// Make room when no fragmented file fits into a free run
+		if(plan_moves(&vol) == 0)
+		{
+			if(count_fragmented(&vol) == 0 || plan_compaction(&vol) == 0)
+			{
+				break;
+			}
+
+			compacting = 1;
+		}
+
+		fprintf(stderr, "Pass %u: %s %u files\n", pass, (compacting ? "compacting" : "moving"), vol.movecount);
+
+		if(verbose || dryrun)
+		{
+			for(i = 0; i < vol.movecount; i++)
+			{
+				fprintf(stderr, "  %-12s %u clusters in %u fragments -> %u\n", vol.files[vol.moves[i]].name,
+					vol.files[vol.moves[i]].clusters, vol.files[vol.moves[i]].fragments, vol.files[vol.moves[i]].target);
+			}
+		}
+
+		if(dryrun)
+		{
+			break;
+		}
+
+		if(!run_moves(&vol, threads))
+		{
+			fprintf(stderr, "Pass %u failed\n", pass);
+			return 1;
+		}
+
+		moved += vol.movecount;
+	}
+
+	if(!dryrun)
+	{
+		if(!refresh_fsinfo(&vol))
+		{
+			fprintf(stderr, "Unable to update FSInfo\n");
+			return 1;
+		}
+
+		fprintf(stderr, "%u files moved, %u left fragmented\n", moved, count_fragmented(&vol));
+	}
+
+	sd_image_close();
+
+	return 0;
+}
@@ -0,0 +1,157 @@
+/***************************************************************************************
+* FAT16/32 filesystem implementation for AVR Microcontrollers
+* Copyright (C) 2013 Johnny Härtell
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Device: host
+*
+* Image file backed replacement for the SD card block functions
+* so the FAT code can be used on card images
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sd.h"
+#include "comms.h"
+#include "sd_image.h"
+
+static int image_fd = -1;
+
+
+/*******************************************************************
+* Open a card image and set up the SD card structure as if the
+* card had been initialized
+* @return int			File descriptor, -1 on failure
+*
+* @param sdcard		SD card structure
+* @param path			Image file
+* @param writable		Open for writing
+*/
+int sd_image_open(sdcard_t *sdcard, const char *path, uint8_t writable)
+{
+	image_fd = open(path, (writable ? O_RDWR : O_RDONLY));
+	
+	if(image_fd < 0)
+	{
+		return -1;
+	}
+	
+	memset(sdcard, 0x00, sizeof(*sdcard));
+	
+	sdcard->inited = 1;
+	sdcard->init_attempted = 1;
+	sdcard->write_protected = !writable;
+	sdcard->blocksize = 512;
+	sdcard->free_clusters = 0xFFFFFFFF;
+	sdcard->next_free_cluster = 2;
+	sdcard->loaded_sector = -1;
+	
+	return image_fd;
+}
+
+/*******************************************************************
+* Close the card image
+*/
+void sd_image_close(void)
+{
+	if(image_fd >= 0)
+	{
+		close(image_fd);
+	}
+	
+	image_fd = -1;
+}
+
+/*******************************************************************
+* Read a data block from the image into sdcard->buffer
+*
+* @param sdcard		SD card structure
+* @param blockaddr	The block address to read
+* @param debug			Not used
+*/
+uint8_t sd_read_block(sdcard_t *sdcard, uint32_t blockaddr, uint8_t debug)
+{
+	if(sdcard->loaded_sector == (int32_t)blockaddr)
+	{
+		return 1;
+	}
+	
+	if(pread(image_fd, sdcard->buffer, 512, (off_t)blockaddr * 512) != 512)
+	{
+		sdcard->loaded_sector = -1;
+		return 0;
+	}
+	
+	sdcard->loaded_sector = blockaddr;
+	
+	return 1;
+}
+
+/*******************************************************************
+* Write a data block to the image from sdcard->buffer
+*
+* @param sdcard		SD card structure
+* @param blockaddr	The block address to write
+* @param debug			Not used
+*/
+uint8_t sd_write_block(sdcard_t *sdcard, uint32_t blockaddr, uint8_t debug)
+{
+	if(sdcard->write_protected)
+	{
+		return 0;
+	}
+	
+	if(pwrite(image_fd, sdcard->buffer, 512, (off_t)blockaddr * 512) != 512)
+	{
+		return 0;
+	}
+	
+	return 1;
+}
+
+/*******************************************************************
+* Write sdcard->buffer to a number of consecutive blocks of the image
+*
+* @param sdcard		SD card structure
+* @param blockaddr	The first block address to write
+* @param count		Number of blocks to write
+*/
+uint8_t sd_write_blocks(sdcard_t *sdcard, uint32_t blockaddr, uint32_t count)
+{
+	uint32_t i;
+	
+	for(i = 0; i < count; i++)
+	{
+		if(!sd_write_block(sdcard, blockaddr + i, 0))
+		{
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+/*******************************************************************
+* No leds on the host
+*/
+void led_on(uint8_t led)
+{
+}
+
+void led_off(uint8_t led)
+{
+}
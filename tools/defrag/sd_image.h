@@ -0,0 +1,33 @@
+/***************************************************************************************
+* FAT16/32 filesystem implementation for AVR Microcontrollers
+* Copyright (C) 2013 Johnny Härtell
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Device: host
+*
+* Image file backed replacement for the SD card block functions
+*/
+#ifndef _SD_IMAGE_H_
+#define _SD_IMAGE_H_
+
+#include "sd.h"
+
+/*
+* Function declarations
+*/
+int sd_image_open(sdcard_t *sdcard, const char *path, uint8_t writable);
+void sd_image_close(void);
+
+#endif